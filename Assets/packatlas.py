@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+# Packs the sprite images into Data/atlas.png (run from the repository root after changing any of them)
+# Layout in 32x32 tiles (4 by 6): rows 0-3 the item tileset, rows 4-5 player (2x2), check, star and spark
+import struct, zlib
+
+TILE, COLS, ROWS = 32, 4, 6
+SPRITES = [ # file, tile column, tile row
+	('Assets/gfx.png',    0, 0),
+	('Assets/player.png', 0, 4),
+	('Assets/check.png',  2, 4),
+	('Assets/star.png',   3, 4),
+	('Assets/spark.png',  2, 5),
+]
+
+def read_png(path):
+	data = open(path, 'rb').read()
+	assert data[:8] == b'\x89PNG\r\n\x1a\n', path
+	pos, idat, plte, trns = 8, b'', None, None
+	while pos < len(data):
+		n, kind = struct.unpack('>I4s', data[pos:pos+8])
+		chunk = data[pos+8:pos+8+n]
+		pos += 12 + n
+		if kind == b'IHDR': w, h, depth, ctype, _, _, interlace = struct.unpack('>IIBBBBB', chunk)
+		elif kind == b'PLTE': plte = chunk
+		elif kind == b'tRNS': trns = chunk
+		elif kind == b'IDAT': idat += chunk
+	assert depth == 8 and not interlace, path + ': only 8-bit non-interlaced images are supported'
+	bpp = { 0: 1, 2: 3, 3: 1, 4: 2, 6: 4 }[ctype]
+	raw, stride, rows, prev = zlib.decompress(idat), w * bpp, [], bytearray(w * bpp)
+	for y in range(h):
+		f, line = raw[y*(stride+1)], bytearray(raw[y*(stride+1)+1:(y+1)*(stride+1)])
+		for i in range(stride):
+			a = line[i-bpp] if i >= bpp else 0
+			b, c = prev[i], (prev[i-bpp] if i >= bpp else 0)
+			if f == 1: line[i] = (line[i] + a) & 255
+			elif f == 2: line[i] = (line[i] + b) & 255
+			elif f == 3: line[i] = (line[i] + ((a + b) >> 1)) & 255
+			elif f == 4:
+				p = a + b - c; pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+				line[i] = (line[i] + (a if pa <= pb and pa <= pc else b if pb <= pc else c)) & 255
+		rows.append(line)
+		prev = line
+	def rgba(line, x):
+		v = line[x*bpp:(x+1)*bpp]
+		if ctype == 0: return (v[0], v[0], v[0], 0 if trns and v[0] == trns[1] else 255)
+		if ctype == 2: return (v[0], v[1], v[2], 255)
+		if ctype == 3: return tuple(plte[v[0]*3:v[0]*3+3]) + ((trns[v[0]] if trns and v[0] < len(trns) else 255),)
+		if ctype == 4: return (v[0], v[0], v[0], v[1])
+		return tuple(v)
+	return w, h, [[rgba(line, x) for x in range(w)] for line in rows]
+
+def write_png(path, w, h, pixels):
+	def chunk(kind, body): return struct.pack('>I', len(body)) + kind + body + struct.pack('>I', zlib.crc32(kind + body) & 0xffffffff)
+	raw = b''.join(b'\0' + bytes(c for px in row for c in px) for row in pixels)
+	open(path, 'wb').write(b'\x89PNG\r\n\x1a\n' + chunk(b'IHDR', struct.pack('>IIBBBBB', w, h, 8, 6, 0, 0, 0)) + chunk(b'IDAT', zlib.compress(raw, 9)) + chunk(b'IEND', b''))
+
+W, H = TILE * COLS, TILE * ROWS
+atlas = [[(0, 0, 0, 0)] * W for y in range(H)]
+for path, tx, ty in SPRITES:
+	w, h, img = read_png(path)
+	assert tx * TILE + w <= W and ty * TILE + h <= H, path + ': does not fit'
+	for y in range(h): atlas[ty * TILE + y][tx * TILE:tx * TILE + w] = img[y]
+# PNG rows go from top to bottom, tile row 0 is at the top
+write_png('Data/atlas.png', W, H, atlas)
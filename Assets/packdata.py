@@ -0,0 +1,38 @@
+#!/usr/bin/env python3
+# Packs the images and the font into DepotMania.pack for desktop builds (make pack, or run it from the repository root after changing anything in Data)
+# The game maps the pack and reads the files straight out of it, the font is stored uncompressed so it never gets inflated
+# and the PNG pixel data is rewritten into stored (level 0) deflate blocks so decoding an image is little more than a copy
+# Layout: 'DMP1', entry count, per entry a 24 byte name and offset and size (little endian), then the files at 16 byte aligned offsets
+import struct, zipfile, zlib
+
+def stored_png(png):
+	assert png[:8] == b'\x89PNG\r\n\x1a\n', 'not a PNG'
+	chunks, idat, pos = [], b'', 8
+	while pos < len(png):
+		size, kind = struct.unpack('>I4s', png[pos:pos+8])
+		body = png[pos+8:pos+8+size]
+		pos += 12 + size
+		if kind == b'IDAT': idat += body
+		else: chunks.append((kind, body))
+	def chunk(kind, body): return struct.pack('>I', len(body)) + kind + body + struct.pack('>I', zlib.crc32(kind + body))
+	out = png[:8]
+	for kind, body in chunks:
+		if kind == b'IEND': out += chunk(b'IDAT', zlib.compress(zlib.decompress(idat), 0))
+		out += chunk(kind, body)
+	return out
+
+FILES = [ # name in the pack, data
+	('atlas.png', stored_png(open('Data/atlas.png', 'rb').read())),
+	('floor.png', stored_png(open('Data/floor.png', 'rb').read())),
+	('wall.png', stored_png(open('Data/wall.png', 'rb').read())),
+	('typomoderno.ttf', zipfile.ZipFile('Data/typomoderno.ttf.zip').read('_')),
+]
+
+align = lambda n: (n + 15) & ~15
+offset, index, data = align(8 + 32 * len(FILES)), b'', b''
+for name, body in FILES:
+	assert len(name) < 24, name + ': name too long'
+	index += struct.pack('<24sII', name.encode(), offset + len(data), len(body))
+	data += body + b'\0' * (align(len(body)) - len(body))
+header = b'DMP1' + struct.pack('<I', len(FILES)) + index
+open('DepotMania.pack', 'wb').write(header + b'\0' * (offset - len(header)) + data)
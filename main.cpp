@@ -27,471 +27,2958 @@
 #include <ZL_Font.h>
 #include <ZL_Input.h>
 #include <ZL_Particles.h>
+#ifndef DEPOTMANIA_PRERENDERED_AUDIO
 #include <ZL_SynthImc.h>
+#endif
+static void* MemCalloc(size_t num, size_t size);
+static void* MemRealloc(void* ptr, size_t size);
+static void MemFree(void* ptr);
+#define cpcalloc MemCalloc
+#define cprealloc MemRealloc
+#define cpfree MemFree
 #include <../Opt/chipmunk/chipmunk.cpp>
+#ifdef DEPOTMANIA_HASTY //chipmunk's threaded solver compiled into this unit like chipmunk.cpp, make HASTY=1 adds its source path and pthreads
+#include <chipmunk/cpHastySpace.h>
+#include <cpHastySpace.c>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 #include <vector>
+#include <deque>
 #include <algorithm>
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#define SOCKET int
+#define INVALID_SOCKET -1
+#endif
+
+//Memory accounting, chipmunk allocates through MemCalloc/MemRealloc/MemFree and each block carries its size and category in front of it
+//The category is what the game was doing at the time (SMemTag), the chipmunk constructors and cpSpaceAdd* are called through wrappers
+//to tag them, the step counts as arbiters and the buffers the spatial index added to its pools during it are moved over to index afterwards
+//The bodies, shapes and joints in the game's own pools are counted as they grow (SMemPool)
+enum EMem { MEM_SPACE, MEM_BODIES, MEM_SHAPES, MEM_CONSTRAINTS, MEM_ARBITERS, MEM_INDEX, MEM_COUNT };
+enum { MEM_HEADER = 16 }; //keeps the blocks 16 byte aligned
+static const char* const memnames[MEM_COUNT] = { "space", "bodies", "shapes", "constraints", "arbiters", "index" };
+static struct SMemCounter { std::atomic<size_t> bytes, count, peak; } memcounters[MEM_COUNT], memtotal; //count is the number of live blocks
+static thread_local int memtag = MEM_SPACE; //batch worlds step on worker threads
+struct SMemTag { int prev; SMemTag(int tag) : prev(memtag) { memtag = tag; } ~SMemTag() { memtag = prev; } };
+
+static void MemCount(int category, ptrdiff_t bytes, int blocks)
+{
+	for (SMemCounter* c : { &memcounters[category], &memtotal })
+	{
+		size_t now = (c->bytes += (size_t)bytes), peak = c->peak.load(std::memory_order_relaxed);
+		while (now > peak && !c->peak.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {}
+		c->count += (size_t)blocks;
+	}
+}
+
+static void* MemCalloc(size_t num, size_t size)
+{
+	int category = memtag;
+	unsigned char* p = (unsigned char*)calloc(1, MEM_HEADER + num * size);
+	if (!p) return NULL;
+	*(size_t*)p = num * size;
+	*(int*)(p + sizeof(size_t)) = category;
+	MemCount(category, (ptrdiff_t)(num * size), 1);
+	return p + MEM_HEADER;
+}
+
+static void* MemRealloc(void* ptr, size_t size)
+{
+	if (!ptr) return MemCalloc(1, size);
+	unsigned char* p = (unsigned char*)ptr - MEM_HEADER;
+	size_t old = *(size_t*)p;
+	int category = *(int*)(p + sizeof(size_t));
+	p = (unsigned char*)realloc(p, MEM_HEADER + size);
+	if (!p) return NULL;
+	*(size_t*)p = size;
+	MemCount(category, (ptrdiff_t)size - (ptrdiff_t)old, 0);
+	return p + MEM_HEADER;
+}
+
+static void MemFree(void* ptr)
+{
+	if (!ptr) return;
+	unsigned char* p = (unsigned char*)ptr - MEM_HEADER;
+	MemCount(*(int*)(p + sizeof(size_t)), -(ptrdiff_t)*(size_t*)p, -1);
+	free(p);
+}
+
+static void MemRetag(void* ptr, int category)
+{
+	unsigned char* p = (unsigned char*)ptr - MEM_HEADER;
+	int& old = *(int*)(p + sizeof(size_t));
+	if (old == category) return;
+	MemCount(old, -(ptrdiff_t)*(size_t*)p, -1);
+	MemCount(category, (ptrdiff_t)*(size_t*)p, 1);
+	old = category;
+}
+
+//The node, pair and bin buffers the index allocates are all kept in its buffer list
+static void MemRetagIndex(cpSpatialIndex* index, bool hash)
+{
+	cpArray* buffers = (hash ? ((cpSpaceHash*)index)->allocatedBuffers : ((cpBBTree*)index)->allocatedBuffers);
+	for (int i = 0; i != buffers->num; i++) MemRetag(buffers->arr[i], MEM_INDEX);
+}
+
+//Size of one of the game's pools, a copied world holds its own copy of the pool
+struct SMemPool
+{
+	int category; size_t bytes = 0, blocks = 0;
+	SMemPool(int _category) : category(_category) {}
+	SMemPool(const SMemPool& o) : category(o.category), bytes(o.bytes), blocks(o.blocks) { MemCount(category, (ptrdiff_t)bytes, (int)blocks); }
+	SMemPool& operator=(const SMemPool& o)
+	{
+		MemCount(o.category, (ptrdiff_t)o.bytes, (int)o.blocks);
+		MemCount(category, -(ptrdiff_t)bytes, -(int)blocks);
+		category = o.category; bytes = o.bytes; blocks = o.blocks;
+		return *this;
+	}
+	~SMemPool() { MemCount(category, -(ptrdiff_t)bytes, -(int)blocks); }
+	void Grow(size_t size) { bytes += size; blocks++; MemCount(category, (ptrdiff_t)size, 1); }
+};
+
+//Box bodies, box shapes and joints live in the game's own pools, only the room walls and the players are allocated by chipmunk
+static cpBody* NewBody(cpFloat mass, cpFloat moment) { SMemTag tag(MEM_BODIES); return cpBodyNew(mass, moment); }
+static cpShape* NewCircleShape(cpBody* body, cpFloat radius, cpVect offset) { SMemTag tag(MEM_SHAPES); return cpCircleShapeNew(body, radius, offset); }
+static cpShape* NewBoxShape(cpBody* body, cpBB box, cpFloat radius) { SMemTag tag(MEM_SHAPES); return cpBoxShapeNew2(body, box, radius); }
+static cpBody* AddBody(cpSpace* space, cpBody* body) { SMemTag tag(MEM_BODIES); return cpSpaceAddBody(space, body); }
+static cpShape* AddShape(cpSpace* space, cpShape* shape) { SMemTag tag(MEM_INDEX); return cpSpaceAddShape(space, shape); } //inserts it into the spatial index
+static cpConstraint* AddConstraint(cpSpace* space, cpConstraint* c) { SMemTag tag(MEM_CONSTRAINTS); return cpSpaceAddConstraint(space, c); }
+
+static ZL_Surface srfGFX, srfPlayer, srfFloor, srfWall, srfCheck, srfStar;
+static ZL_Font fntMain, fntBig;
+static ZL_Rect clearrec;
+static bool title, goback, headless;
+static const ZL_Color shadow = ZLLUMA(0, .75f);
+#ifdef DEPOTMANIA_PRERENDERED_AUDIO //music and sounds exported from the IMC tracks to ogg files instead of synthesizing them
+static ZL_Sound sndMusic;
+#else
+extern ZL_SynthImcTrack imcMusic;
+extern TImcSongData imcDataIMCMUSIC, imcDataIMCPICKUP, imcDataIMCDROP, imcDataIMCCHECK, imcDataIMCSTAR;
+#endif
+static ZL_Sound sndPickup, sndDrop, sndCheck, sndStar;
+
+//Text with its black border and drop shadow rendered once into a surface of its own so drawing it is a single quad
+//Set only renders again when the text actually changes, the surface is only recreated when its size changes
+struct SCachedText
+{
+	ZL_TextBuffer buf;
+	ZL_Surface srf;
+	ZL_String text;
+	scalar scale;
+	ZL_Color fill;
+	int border, shadowoff, pad;
+
+	SCachedText() {}
+	SCachedText(const ZL_Font& fnt, const char* str, scalar _scale = 1, const ZL_Color& _fill = ZLWHITE, int _border = 0, int _shadowoff = 0)
+		: buf(fnt), scale(_scale), fill(_fill), border(_border), shadowoff(_shadowoff), pad(_border + _shadowoff) { Set(str); }
+
+	void Set(const char* str)
+	{
+		if (srf && text == str) return;
+		text = str;
+		buf.SetText(str);
+		ZL_Vector dim = buf.GetDimensions() * scale;
+		int w = (int)sceil(dim.x) + pad * 2, h = (int)sceil(dim.y) + pad * 2;
+		if (!srf || srf.GetWidth() != w || srf.GetHeight() != h) srf = ZL_Surface(w, h, true).SetOrigin(ZL_Origin::Center);
+		srf.RenderToBegin(true);
+		if (shadowoff) buf.Draw(pad+shadowoff, pad-shadowoff, scale, scale, shadow);
+		if (border) for (int i = 0; i < 9; i++) if (i != 4) buf.Draw(pad+(border*((i%3)-1)), pad+(border*((i/3)-1)), scale, scale, ZLBLACK);
+		buf.Draw(pad, pad, scale, scale, fill);
+		srf.RenderToEnd();
+	}
+
+	void Draw(const ZL_Vector& p) const { srf.Draw(p); } //centered
+	void DrawBottomLeft(scalar x, scalar y) const { srf.Draw(x - pad + srf.GetWidth()/2, y - pad + srf.GetHeight()/2); }
+};
+static SCachedText txtItems, txtScore, txtExpansion;
+
+struct SInput { signed char x, y; bool grab, strafe; };
+
+//Broadphase of the physics spaces, the spatial hash uses one cell per room cell since every box is a unit box on the integer grid
+enum { BROADPHASE_TREE, BROADPHASE_HASH };
+static int broadphase = BROADPHASE_TREE;
+static const char* BroadphaseNames[] = { "tree", "hash" };
+
+//Solver iterations of the physics spaces and the threaded solver (chipmunk's hasty space) a world switches to once it holds more than hastyboxes boxes
+//The hasty space needs cpHastySpace.c and pthreads, so it is only available when DEPOTMANIA_HASTY is defined
+//A world goes back to the plain solver once it holds no more than 3/4 of hastyboxes boxes, so clears around the threshold don't flip it every few ticks
+static int solveriterations = 10, solverthreads = 0, hastyboxes = 150; //0 threads means off
+
+//Item types use the 16 tiles of the tileset, stress runs can have more and tint the tiles of the types past the first 16
+enum { ITEM_TILES = 16, ITEMS_MAX = 64 };
+
+//Stress mode started with -stress, a fixed room of size x size cells (rounded up to odd) with items types that spawn every
+//tickPerBox ms at the door plus at spawners-1 points along the top wall, reports when a section first breaks the 16 ms frame budget
+static struct SStress
+{
+	int size, items, tickPerBox, spawners;
+	bool over[4], done;
+} stress;
+
+//Time spent in the sections of the current frame in microseconds and the number of physics steps it took
+struct SProfile { double frame, input, step, match, boxes, hud, particles; int substeps; };
+static double ProfileTime() { return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+//Game randomness comes from the seed alone so a game can be replayed from its seed and the input of every tick
+static std::vector<unsigned char> playback;
+static size_t playbackpos;
+
+//What happened in the simulation since the last frame was presented
+struct SEvents
+{
+	bool pickup, drop, check, star, score, room;
+	std::vector<cpVect> sparks;
+};
+
+//Frame profiler toggled with F3, shows a rolling frame time graph with the section breakdown and F4 writes the recorded frames to a CSV file
+struct SProfileSample { SProfile prof; int frame, interval, bodies, shapes, constraints, particles; };
+static struct SProfiler
+{
+	bool active;
+	int frame;
+	size_t next;
+	std::vector<SProfileSample> samples;
+} profiler;
+enum { PROFILER_SAMPLES = 3600, PROFILER_GRAPH = 240 };
+
+struct SCluster { int item, cell; size_t first, count; };
+
+//Bitplanes of the room with one bit per cell for each item type, rows padded to 64-bit words, rebuilt from the box bodies on every physics step
+//'aligned' has the cells with a straight box sitting exactly on them, 'loose' every cell center overlapped by a box that isn't being carried
+//'dirty' has the cells of each item plane that changed in either of them since the last Match, only groups touching those are scanned again
+struct SGrid
+{
+	int w, h, stride, plane;
+	std::vector<uint64_t> aligned, loose, lastaligned, lastloose, dirty, work, comp;
+	bool anydirty;
+};
+
+struct SPlayer
+{
+	cpBody* body;
+	cpShape *mainshape, *grabshape;
+	cpFloat angle = 0;
+	cpVect prevp;
+	cpFloat preva;
+};
+
+//Everything a running game simulates, the game on screen is one world and batch runs step many of them side by side on worker threads
+//The chipmunk space has its world as user data so physics callbacks can find their way back to it
+struct SWorld
+{
+	cpSpace *space;
+	cpBody *roombody, *spawnboxbody;
+	cpBB room;
+	int tickNextBox, tickPerBox, tickNextDrop, hashcells;
+	int level, nitems, itemtypes, score, expansion, itemNextBox, boxes;
+	unsigned char itemindices[ITEMS_MAX];
+	unsigned char itemgoals[ITEMS_MAX];
+	bool gameover, win, hasty;
+	SPlayer player, player2; //player2 only has a body in co-op games
+	SEvents events;
+	SGrid grid;
+	std::vector<cpBody*> found;
+	std::vector<SCluster> clusters;
+	unsigned int seed, randstate;
+	std::vector<unsigned char> recording;
+	SProfile prof;
+
+	//Box bodies with their shape and the grab joints come from pools that keep their memory for the whole run
+	//Cleared boxes and released joints go back to the free lists and Init hands everything back at once
+	//The live boxes are also kept in a dense registry (in no particular order) so drawing and matching don't have to walk the space
+	//A box body's user data points back at its SBox, cells x0/y0 to x1/y1 are the ones its bounding box covers in the grid
+	enum { BOX_GRABBED = 1, BOX_SPAWNING = 2, BOX_SETTLED = 4 }; //settled is neither grabbed nor spawning so it gets snapped to the grid
+	struct SBox
+	{
+		cpBody body;
+		cpPolyShape shape;
+		cpVect prevp; cpFloat preva; //body state before the last step for drawing in between
+		int item, slot, state, x0, y0, x1, y1; //slot is the index in live
+	};
+	std::deque<SBox> boxstore;
+	std::deque<cpPinJoint> jointstore;
+	std::vector<SBox*> boxfree, live, settled;
+	std::vector<scalar> snapx, snapy;
+	std::vector<cpPinJoint*> jointfree;
+	SMemPool poolbodies{MEM_BODIES}, poolshapes{MEM_SHAPES}, pooljoints{MEM_CONSTRAINTS};
+
+	void Init(unsigned int _seed, int players = 1);
+	void Free();
+	cpSpace* NewSpace(bool _hasty);
+	void SetHasty(bool enable);
+	void SetRoom(int _level = 0);
+	void StorePrevious();
+	void BuildRoom();
+	void SaveState(std::vector<unsigned char>& out);
+	bool LoadState(const unsigned char* data, size_t size);
+	void Tick(const SInput& in, const SInput& in2 = SInput());
+	void TickPlayer(SPlayer& p, const SInput& in);
+	void Match();
+	void ResetEvents();
+	cpBody* AddBox(int item, cpVect p, cpFloat size);
+	void RemoveBody(cpBody* body);
+	cpConstraint* NewJoint(cpBody* a, cpBody* b, cpVect anchorA, cpVect anchorB);
+	void FreeJoint(cpConstraint* c);
+	int GameRand(int min, int max);
+	void GridReset();
+	void GridAddBox(cpBody* body);
+	int GridBitCount(const uint64_t* bits, int y0, int y1);
+	void GridFlood(uint64_t* bits, const uint64_t* mask, int& y0, int& y1);
+	void GridFindClusters();
+	void MoveBoxes(cpFloat dt);
+};
+static SWorld game;
+
+//A file mapped into memory, writable and resized to 'create' bytes when that is given, read only and as large as the file otherwise
+struct SMappedFile
+{
+	unsigned char* data = NULL;
+	size_t size = 0;
+	#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE, mapping = NULL;
+	#endif
+	bool Open(const char* path, size_t create = 0);
+	void Close();
+};
+
+bool SMappedFile::Open(const char* path, size_t create)
+{
+	#ifdef _WIN32
+	file = CreateFileA(path, (create ? GENERIC_READ|GENERIC_WRITE : GENERIC_READ), FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, (create ? CREATE_ALWAYS : OPEN_EXISTING), FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER len;
+	if (create) len.QuadPart = (LONGLONG)create;
+	else if (!GetFileSizeEx(file, &len)) len.QuadPart = 0;
+	size = (size_t)len.QuadPart;
+	if (size) mapping = CreateFileMappingA(file, NULL, (create ? PAGE_READWRITE : PAGE_READONLY), (DWORD)len.HighPart, len.LowPart, NULL);
+	if (mapping) data = (unsigned char*)MapViewOfFile(mapping, (create ? FILE_MAP_WRITE : FILE_MAP_READ), 0, 0, size);
+	if (!data) { Close(); return false; }
+	#else
+	int fd = open(path, (create ? O_RDWR|O_CREAT|O_TRUNC : O_RDONLY), 0644);
+	if (fd < 0) return false;
+	struct stat st;
+	if (create ? ftruncate(fd, (off_t)create) : fstat(fd, &st)) { close(fd); return false; }
+	size = (create ? create : (size_t)st.st_size);
+	void* p = (size ? mmap(NULL, size, (create ? PROT_READ|PROT_WRITE : PROT_READ), MAP_SHARED, fd, 0) : MAP_FAILED);
+	close(fd); //the mapping stays valid without the descriptor
+	if (p == MAP_FAILED) { size = 0; return false; }
+	data = (unsigned char*)p;
+	#endif
+	return true;
+}
+
+void SMappedFile::Close()
+{
+	#ifdef _WIN32
+	if (data) UnmapViewOfFile(data);
+	if (mapping) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+	#else
+	if (data) munmap(data, size);
+	#endif
+	data = NULL;
+	size = 0;
+}
+
+//Telemetry turned on with -telemetry <file>, what happens in the game on screen goes out as fixed size records into a ring buffer
+//in a memory mapped file that another process can follow with -readtelemetry <file> without the game ever waiting for it
+//The game clears a record's sequence number, fills it and then publishes the number, a reader loads the number, copies the record
+//and loads the number again, and reads the record over when the game was writing it in the meantime (a seqlock)
+//The fields are relaxed atomics so the copy racing with the game is well defined, they compile to plain loads and stores
+enum ETelemetry { TELEMETRY_SPAWN = 1, TELEMETRY_GRAB, TELEMETRY_DROP, TELEMETRY_CLEAR, TELEMETRY_ROOM, TELEMETRY_GAMEOVER, TELEMETRY_FRAME };
+enum { TELEMETRY_RECORDS = 1 << 14 };
+struct STelemetryRecord { std::atomic<unsigned int> seq, type, tick; std::atomic<int> a, b, c; std::atomic<float> x, y; }; //seq is the record number + 1, 0 while being written
+struct STelemetryRing { char magic[4]; unsigned int recordsize, records; std::atomic<unsigned int> head; STelemetryRecord ring[TELEMETRY_RECORDS]; };
+static struct STelemetry { SMappedFile file; STelemetryRing* ring; const SWorld* world = &game; } telemetry;
+
+static bool TelemetryOpen(const char* path)
+{
+	if (!telemetry.file.Open(path, sizeof(STelemetryRing))) return false;
+	telemetry.ring = (STelemetryRing*)telemetry.file.data;
+	telemetry.ring->recordsize = sizeof(STelemetryRecord);
+	telemetry.ring->records = TELEMETRY_RECORDS;
+	memcpy(telemetry.ring->magic, "DMT1", 4);
+	return true;
+}
+
+//Only the world shown on screen reports, so batch worlds and the co-op prediction stay quiet
+static void Telemetry(const SWorld* w, ETelemetry type, int a = 0, int b = 0, int c = 0, float x = 0, float y = 0)
+{
+	if (!telemetry.ring || w != telemetry.world) return;
+	unsigned int n = telemetry.ring->head.load(std::memory_order_relaxed);
+	STelemetryRecord& rec = telemetry.ring->ring[n % TELEMETRY_RECORDS];
+	rec.seq.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	rec.type.store(type, std::memory_order_relaxed);
+	rec.tick.store((unsigned int)(w->recording.size() / (w->player2.body ? 2 : 1)), std::memory_order_relaxed);
+	rec.a.store(a, std::memory_order_relaxed); rec.b.store(b, std::memory_order_relaxed); rec.c.store(c, std::memory_order_relaxed);
+	rec.x.store(x, std::memory_order_relaxed); rec.y.store(y, std::memory_order_relaxed);
+	rec.seq.store(n + 1, std::memory_order_release);
+	telemetry.ring->head.store(n + 1, std::memory_order_release);
+}
+
+//Prints the records of a telemetry file as text, oldest first, and with follow keeps waiting for new ones
+static void ReadTelemetry(const char* path, bool follow)
+{
+	SMappedFile f;
+	const STelemetryRing* r = (f.Open(path) && f.size >= sizeof(STelemetryRing) ? (const STelemetryRing*)f.data : NULL);
+	if (!r || memcmp(r->magic, "DMT1", 4) || r->recordsize != sizeof(STelemetryRecord) || r->records != TELEMETRY_RECORDS) { printf("Could not read telemetry %s\n", path); return; }
+	unsigned int head = r->head.load(std::memory_order_acquire), next = (head > TELEMETRY_RECORDS ? head - TELEMETRY_RECORDS : 0), retries = 0;
+	for (;; next++)
+	{
+		for (; next == (head = r->head.load(std::memory_order_acquire)); std::this_thread::sleep_for(std::chrono::milliseconds(10)))
+			if (!follow) { f.Close(); return; } else fflush(stdout);
+		if ((int)(head - next) < 0) { printf("restarted\n"); next = 0; } //the game opened the file again
+		if (head - next > TELEMETRY_RECORDS) { printf("lost %u records\n", head - next - TELEMETRY_RECORDS); next = head - TELEMETRY_RECORDS; }
+		const STelemetryRecord& src = r->ring[next % TELEMETRY_RECORDS];
+		unsigned int seq = src.seq.load(std::memory_order_acquire);
+		unsigned int type = src.type.load(std::memory_order_relaxed), tick = src.tick.load(std::memory_order_relaxed);
+		int a = src.a.load(std::memory_order_relaxed), b = src.b.load(std::memory_order_relaxed), c = src.c.load(std::memory_order_relaxed);
+		float x = src.x.load(std::memory_order_relaxed), y = src.y.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (seq != next + 1 || src.seq.load(std::memory_order_relaxed) != seq)
+		{
+			//the game is overwriting it, read it over once it is done and head tells how many records it lapped
+			//(unless the game died in the middle of a write)
+			if (++retries == 1000) { printf("lost 1 record\n"); retries = 0; continue; }
+			std::this_thread::yield();
+			next--;
+			continue;
+		}
+		retries = 0;
+		switch (type)
+		{
+			case TELEMETRY_SPAWN: printf("%u spawn item %d at %.1f %.1f\n", tick, a, x, y); break;
+			case TELEMETRY_GRAB: printf("%u grab player %d item %d\n", tick, a + 1, b); break;
+			case TELEMETRY_DROP: printf("%u drop player %d item %d\n", tick, a + 1, b); break;
+			case TELEMETRY_CLEAR: printf("%u clear item %d area %d score %d\n", tick, a, b, c); break;
+			case TELEMETRY_ROOM: printf("%u room level %d size %dx%d\n", tick, a, b, c); break;
+			case TELEMETRY_GAMEOVER: printf("%u gameover score %d level %d boxes %d\n", tick, a, b, c); break;
+			case TELEMETRY_FRAME: printf("%u frame %.2f ms step %.2f ms substeps %d boxes %d sparks %d\n", tick, x, y, a, b, c); break;
+			default: printf("%u unknown record %u\n", tick, type);
+		}
+	}
+}
+
+static void FixVelocityFunc(cpBody *body, cpVect gravity, cpFloat damping, cpFloat dt) {}
+static void FixUpdatePositionFunc(cpBody *body, cpFloat dt) {}
+
+void SWorld::GridReset()
+{
+	grid.w = (int)(room.r - room.l + .5f);
+	grid.h = (int)(room.t - room.b + .5f);
+	grid.stride = (grid.w + 63) / 64;
+	grid.plane = grid.h * grid.stride;
+	size_t n = (size_t)grid.plane * itemtypes;
+	grid.aligned.assign(n, 0);
+	grid.loose.assign(n, 0);
+	grid.lastaligned.assign(n, 0);
+	grid.lastloose.assign(n, 0);
+	grid.work.assign(grid.plane, 0);
+	grid.comp.assign(grid.plane, 0); //kept all zero outside of GridFindClusters
+	grid.dirty.assign(n, ~0ull);
+	grid.anydirty = true;
+}
+
+void SWorld::GridAddBox(cpBody* body)
+{
+	SBox* box = (SBox*)body;
+	box->x0 = box->y0 = 0;
+	box->x1 = box->y1 = -1;
+	if (body->constraintList) return;
+	uint64_t *aligned = &grid.aligned[box->item * grid.plane], *loose = &grid.loose[box->item * grid.plane];
+
+	cpBB bb = body->shapeList->bb;
+	int x0 = box->x0 = ZL_Math::Max((int)sceil(bb.l - .01f - room.l - .5f), 0), x1 = box->x1 = ZL_Math::Min((int)sfloor(bb.r + .01f - room.l - .5f), grid.w-1);
+	int y0 = box->y0 = ZL_Math::Max((int)sceil(bb.b - .01f - room.b - .5f), 0), y1 = box->y1 = ZL_Math::Min((int)sfloor(bb.t + .01f - room.b - .5f), grid.h-1);
+	for (int y = y0; y <= y1; y++)
+		for (int x = x0; x <= x1; x++)
+			loose[y * grid.stride + x / 64] |= 1ull << (x & 63);
+
+	float diffa = smod(PI2*10 + body->a + PIHALF/2, PIHALF) - PIHALF/2;
+	int x = (int)sfloor(body->p.x - room.l), y = (int)sfloor(body->p.y - room.b);
+	if (sabs(diffa) > 0.01f || x < 0 || y < 0 || x >= grid.w || y >= grid.h) return;
+	if (sabs(body->p.x - (room.l + .5f + x)) > 0.05f || sabs(body->p.y - (room.b + .5f + y)) > 0.05f) return;
+	aligned[y * grid.stride + x / 64] |= 1ull << (x & 63);
+}
+
+static int GridLowestBit(uint64_t v) //v must not be 0
+{
+	#if defined(_MSC_VER) && defined(_M_X64)
+	unsigned long bit;
+	_BitScanForward64(&bit, v);
+	return (int)bit;
+	#elif defined(_MSC_VER)
+	unsigned long bit;
+	if (_BitScanForward(&bit, (unsigned long)v)) return (int)bit;
+	_BitScanForward(&bit, (unsigned long)(v >> 32));
+	return (int)bit + 32;
+	#else
+	return __builtin_ctzll(v);
+	#endif
+}
+
+int SWorld::GridBitCount(const uint64_t* bits, int y0, int y1)
+{
+	int n = 0;
+	for (int i = y0 * grid.stride; i != (y1 + 1) * grid.stride; i++)
+	{
+		#ifdef _MSC_VER
+		for (uint64_t v = bits[i]; v; v &= v - 1) n++;
+		#else
+		n += __builtin_popcountll(bits[i]);
+		#endif
+	}
+	return n;
+}
+
+//Grows g along the runs of set bits in m towards both ends of the word, doubling the reach every step
+static uint64_t GridFillRuns(uint64_t g, uint64_t m)
+{
+	uint64_t up = g & m, down = up, mu = m, md = m;
+	for (int shift = 1; shift != 64; shift <<= 1)
+	{
+		up |= mu & (up << shift); mu &= mu << shift;
+		down |= md & (down >> shift); md &= md >> shift;
+	}
+	return up | down;
+}
+
+//Grows the set bits into all 4-connected cells of mask, sweeping up and back down over only the rows y0 to y1 that have bits
+//and the rows next to them, y0/y1 widen as the group grows, the runs of a row word fill in one go
+void SWorld::GridFlood(uint64_t* bits, const uint64_t* mask, int& y0, int& y1)
+{
+	auto row = [&](int y)
+	{
+		uint64_t *r = bits + y * grid.stride, *below = (y ? r - grid.stride : NULL), *above = (y != grid.h-1 ? r + grid.stride : NULL);
+		const uint64_t *m = mask + y * grid.stride;
+		bool changed = false;
+		for (int i = 0; i != grid.stride; i++)
+		{
+			uint64_t g = r[i];
+			if (i) g |= r[i-1] >> 63;
+			if (i != grid.stride-1) g |= r[i+1] << 63;
+			if (below) g |= below[i];
+			if (above) g |= above[i];
+			if ((g = GridFillRuns(g, m[i])) != r[i]) { r[i] = g; changed = true; }
+		}
+		if (changed) { y0 = ZL_Math::Min(y0, y); y1 = ZL_Math::Max(y1, y); }
+		return changed;
+	};
+	for (bool changed = true; changed;)
+	{
+		changed = false;
+		for (int y = ZL_Math::Max(y0 - 1, 0); y <= ZL_Math::Min(y1 + 1, grid.h - 1); y++) changed |= row(y);
+		for (int y = ZL_Math::Min(y1 + 1, grid.h - 1); y >= ZL_Math::Max(y0 - 1, 0); y--) changed |= row(y);
+	}
+}
+
+//Fills clusters (and their bodies into found) with every group that has at least 4 aligned connected boxes of the same item
+//Once the 4 aligned boxes are there, boxes connected to them that are not perfectly aligned are taken along as well
+void SWorld::GridFindClusters()
+{
+	clusters.clear();
+	found.clear();
+	for (int item = 0; item != itemtypes; item++)
+	{
+		const uint64_t *aligned = &grid.aligned[item * grid.plane], *loose = &grid.loose[item * grid.plane], *dirty = &grid.dirty[item * grid.plane];
+		//seeds are the aligned cells on or next to a changed cell, the flood then takes in the rest of their groups
+		//any other group was already there unchanged at the last Match, and had it been 4 or more it would be gone
+		bool seeds = false;
+		for (int i = 0; i != grid.plane; i++)
+		{
+			int x = i % grid.stride;
+			uint64_t d = dirty[i], near = d | (d << 1) | (d >> 1);
+			if (x) near |= dirty[i-1] >> 63;
+			if (x != grid.stride-1) near |= dirty[i+1] << 63;
+			if (i >= grid.stride) near |= dirty[i-grid.stride];
+			if (i + grid.stride < grid.plane) near |= dirty[i+grid.stride];
+			seeds |= !!(grid.work[i] = aligned[i] & near);
+		}
+		for (int i = 0; i != grid.plane && seeds; i++)
+		{
+			while (grid.work[i])
+			{
+				int y0 = i / grid.stride, y1 = y0, cell = y0 * grid.w + (i % grid.stride) * 64 + GridLowestBit(grid.work[i]);
+				grid.comp[i] = grid.work[i] & (~grid.work[i] + 1);
+				GridFlood(&grid.comp[0], aligned, y0, y1);
+				bool clear = (GridBitCount(&grid.comp[0], y0, y1) >= 4);
+				if (clear) GridFlood(&grid.comp[0], loose, y0, y1);
+				uint64_t *work = &grid.work[y0 * grid.stride], *comp = &grid.comp[y0 * grid.stride];
+				size_t rows = (size_t)(y1 - y0 + 1) * grid.stride;
+				for (size_t j = 0; j != rows; j++) work[j] &= ~comp[j];
+				if (!clear) { std::fill(comp, comp + rows, 0); continue; }
+
+				//every box of the item that covers a cell of the group, the same cells it set in the loose plane
+				SCluster c = { item, cell, found.size(), 0 };
+				for (SBox* box : live)
+				{
+					if (box->item != item || box->body.constraintList || box->y1 < y0 || box->y0 > y1) continue;
+					bool hit = false;
+					for (int y = box->y0; y <= box->y1 && !hit; y++)
+						for (int x = box->x0; x <= box->x1 && !hit; x++)
+							hit = !!(grid.comp[y * grid.stride + x / 64] & (1ull << (x & 63)));
+					if (hit) found.push_back(&box->body);
+				}
+				std::sort(found.begin() + c.first, found.end()); //removal order by address as it was when they were found through the space
+				c.count = found.size() - c.first;
+				clusters.push_back(c);
+				std::fill(comp, comp + rows, 0);
+			}
+		}
+	}
+	std::sort(clusters.begin(), clusters.end(), [](const SCluster& a, const SCluster& b) { return a.cell < b.cell; });
+}
+
+int SWorld::GameRand(int min, int max)
+{
+	randstate = randstate * 1664525u + 1013904223u;
+	return min + (int)((randstate >> 8) % (unsigned int)(max - min + 1));
+}
+
+static unsigned char EncodeInput(const SInput& in)
+{
+	return (unsigned char)((in.x + 1) | ((in.y + 1) << 2) | (in.grab ? 16 : 0) | (in.strafe ? 32 : 0));
+}
+
+static SInput DecodeInput(unsigned char c)
+{
+	SInput in = { (signed char)((c & 3) - 1), (signed char)(((c >> 2) & 3) - 1), !!(c & 16), !!(c & 32) };
+	return in;
+}
+
+static void PutVarint(std::vector<unsigned char>& out, size_t n)
+{
+	for (; n >= 0x80; n >>= 7) out.push_back((unsigned char)((n & 0x7F) | 0x80));
+	out.push_back((unsigned char)n);
+}
+
+//Reads a varint that has to end before end, false if it is cut off or too long for a size_t
+static bool GetVarint(const unsigned char*& p, const unsigned char* end, size_t& n)
+{
+	n = 0;
+	for (int shift = 0; p != end && shift < (int)sizeof(size_t) * 8; shift += 7)
+	{
+		unsigned char b = *p++;
+		n |= (size_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) return true;
+	}
+	return false;
+}
+
+//Replay files are "DMR1", the seed (little endian) and then runs of input bytes each followed by the run length as a 7-bit varint, a replay longer than a day is rejected
+enum { REPLAY_MAXTICKS = 1000 / 16 * 60 * 60 * 24 };
+static void SaveReplay(const char* path)
+{
+	FILE* f = fopen(path, "wb");
+	if (!f) return;
+	unsigned char hdr[8] = { 'D', 'M', 'R', '1', (unsigned char)game.seed, (unsigned char)(game.seed >> 8), (unsigned char)(game.seed >> 16), (unsigned char)(game.seed >> 24) };
+	fwrite(hdr, 1, 8, f);
+	for (size_t i = 0, n; i != game.recording.size(); i += n)
+	{
+		for (n = 1; i + n != game.recording.size() && game.recording[i + n] == game.recording[i];) n++;
+		fputc(game.recording[i], f);
+		size_t len = n;
+		for (; len >= 0x80; len >>= 7) fputc((int)(len & 0x7F) | 0x80, f);
+		fputc((int)len, f);
+	}
+	fclose(f);
+}
+
+static bool LoadReplay(const char* path, unsigned int* replayseed)
+{
+	FILE* f = fopen(path, "rb");
+	if (!f) return false;
+	unsigned char hdr[8];
+	if (fread(hdr, 1, 8, f) != 8 || memcmp(hdr, "DMR1", 4)) { fclose(f); return false; }
+	*replayseed = hdr[4] | (hdr[5] << 8) | (hdr[6] << 16) | ((unsigned int)hdr[7] << 24);
+	std::vector<unsigned char> data;
+	unsigned char buf[4096];
+	for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) != 0;) data.insert(data.end(), buf, buf + n);
+	fclose(f);
+	playback.clear();
+	playbackpos = 0;
+	for (const unsigned char *p = data.data(), *end = p + data.size(); p != end;)
+	{
+		unsigned char c = *p++;
+		size_t len;
+		if (!GetVarint(p, end, len) || len > REPLAY_MAXTICKS - playback.size()) { playback.clear(); return false; }
+		playback.insert(playback.end(), len, c);
+	}
+	return true;
+}
+
+void SWorld::RemoveBody(cpBody* body)
+{
+	while (body->constraintList) { cpConstraint* c = body->constraintList; cpSpaceRemoveConstraint(space, c); FreeJoint(c); }
+	if (body->userData)
+	{
+		SBox* box = (SBox*)body;
+		cpShape* shp = body->shapeList;
+		cpSpaceRemoveShape(space, shp);
+		cpShapeDestroy(shp);
+		cpSpaceRemoveBody(space, body);
+		cpBodyDestroy(body);
+		live[box->slot] = live.back();
+		live[box->slot]->slot = box->slot;
+		live.pop_back();
+		boxfree.push_back(box);
+		boxes--;
+		return;
+	}
+	while (body->shapeList) { cpShape* shp = body->shapeList; cpSpaceRemoveShape(space, shp); cpShapeFree(shp); }
+	cpSpaceRemoveBody(space, body);
+	cpBodyFree(body);
+}
+
+cpConstraint* SWorld::NewJoint(cpBody* a, cpBody* b, cpVect anchorA, cpVect anchorB)
+{
+	if (jointfree.empty()) { jointstore.emplace_back(); jointfree.push_back(&jointstore.back()); pooljoints.Grow(sizeof(cpPinJoint)); }
+	cpPinJoint* joint = jointfree.back();
+	jointfree.pop_back();
+	return (cpConstraint*)cpPinJointInit(joint, a, b, anchorA, anchorB);
+}
+
+void SWorld::FreeJoint(cpConstraint* c)
+{
+	cpConstraintDestroy(c);
+	jointfree.push_back((cpPinJoint*)c);
+}
+
+//Integrates the box positions right before the step instead of in chipmunk's position callback (box bodies have a no-op one) so the settled
+//boxes can be snapped towards the grid in one pass over packed arrays, nothing the step does before the callbacks touches the boxes
+//Chipmunk has unthreaded all arbiters by the time it calls the position callbacks, so whether a box touches anything never mattered for the snap
+void SWorld::MoveBoxes(cpFloat dt)
+{
+	settled.clear();
+	for (SBox* box : live)
+	{
+		cpBodyUpdatePosition(&box->body, dt);
+		cpShapeCacheBB(&box->shape.shape); //same bounding box the step is about to calculate for the spatial index
+		box->state = (box->body.constraintList ? BOX_GRABBED : 0) | (&box->body == spawnboxbody ? BOX_SPAWNING : 0);
+		if (!box->state) settled.push_back(box);
+	}
+
+	//x - floor(x) is exactly fmod(x, 1) for the positive values here and doesn't keep these loops from being vectorized
+	size_t n = settled.size();
+	snapx.resize(n);
+	snapy.resize(n);
+	for (size_t i = 0; i != n; i++) { snapx[i] = (scalar)(settled[i]->body.p.x + 1000.f + .5f); snapy[i] = (scalar)(settled[i]->body.p.y + 1000.f + .5f); }
+	for (size_t i = 0; i != n; i++) snapx[i] = snapx[i] - sfloor(snapx[i]) - .5f;
+	for (size_t i = 0; i != n; i++) snapy[i] = snapy[i] - sfloor(snapy[i]) - .5f;
+	for (size_t i = 0; i != n; i++)
+	{
+		cpBody* body = &settled[i]->body;
+		float diffa = smod(PI2*10 + body->a + PIHALF/2, PIHALF) - PIHALF/2; //not a unit divisor, stays fmod to give the same angles
+		body->a -= diffa*.1f;
+		body->p = cpvsub(body->p, cpvmult(cpv(snapx[i], snapy[i]), .05f));
+		settled[i]->state = BOX_SETTLED;
+	}
+
+	for (SBox* box : live) GridAddBox(&box->body);
+}
+
+cpBody* SWorld::AddBox(int item, cpVect p, cpFloat size)
+{
+	if (boxfree.empty())
+	{
+		boxstore.emplace_back();
+		boxfree.push_back(&boxstore.back());
+		poolbodies.Grow(sizeof(cpBody));
+		poolshapes.Grow(sizeof(cpPolyShape));
+	}
+	SBox* box = boxfree.back();
+	boxfree.pop_back();
+	cpBody* body = AddBody(space, cpBodyInit(&box->body, 0.1f, cpMomentForBox(0.1f, 1, 1)));
+	cpBodySetUserData(body, box);
+	cpBodySetPosition(body, p);
+	AddShape(space, (cpShape*)cpBoxShapeInit(&box->shape, body, size, size, 0.01f));
+	cpBodySetPositionUpdateFunc(body, FixUpdatePositionFunc); //moved by MoveBoxes
+	box->prevp = p;
+	box->preva = 0;
+	box->item = item;
+	box->slot = (int)live.size();
+	box->state = (size < .91f ? BOX_SPAWNING : 0);
+	box->x0 = box->y0 = 0;
+	box->x1 = box->y1 = -1;
+	live.push_back(box);
+	boxes++;
+	return body;
+}
+
+//Sparks of cleared boxes stored as one array per property so updating them is a few plain loops, drawn in a single batch
+//A burst gets fewer sparks per box when the store runs out of room, and if it still doesn't fit the oldest sparks make way
+enum { SPARKS_MAX = 4096, SPARKS_PER_BOX = 25, SPARKS_MIN_PER_BOX = 4 };
+static struct SSparks
+{
+	ZL_Surface srf;
+	int count;
+	float x[SPARKS_MAX], y[SPARKS_MAX], vx[SPARKS_MAX], vy[SPARKS_MAX], t[SPARKS_MAX], rate[SPARKS_MAX]; //t goes from 0 at spawn to 1 at death
+
+	void Spawn(const std::vector<cpVect>& at)
+	{
+		if (at.empty()) return;
+		int n = (int)at.size(), per = ZL_Math::Clamp((SPARKS_MAX - count) / n, (int)SPARKS_MIN_PER_BOX, (int)SPARKS_PER_BOX), add = ZL_Math::Min(n * per, (int)SPARKS_MAX);
+		if (count + add > SPARKS_MAX) Evict(count + add - SPARKS_MAX);
+		for (int i = 0; i != add; i++, count++)
+		{
+			scalar a = RAND_FACTOR * PI2, v = 0.7f + RAND_FACTOR * 0.6f;
+			x[count] = at[i / per].x + (RAND_FACTOR - .5f) * .5f;
+			y[count] = at[i / per].y + (RAND_FACTOR - .5f) * .5f;
+			vx[count] = scos(a) * v;
+			vy[count] = ssin(a) * v;
+			t[count] = 0;
+			rate[count] = 1.0f / (0.5f + RAND_FACTOR * 0.2f);
+		}
+	}
+
+	void Evict(int n)
+	{
+		float* arrays[] = { x, y, vx, vy, t, rate };
+		for (float* a : arrays) memmove(a, a + n, (count - n) * sizeof(float));
+		count -= n;
+	}
+
+	void Update(float dt)
+	{
+		for (int i = 0; i != count; i++) x[i] += vx[i] * dt;
+		for (int i = 0; i != count; i++) y[i] += vy[i] * dt;
+		for (int i = 0; i != count; i++) t[i] += rate[i] * dt;
+		int n = 0; //keeps spawn order so the oldest are always at the front
+		for (int i = 0; i != count; i++)
+		{
+			if (t[i] >= 1) continue;
+			x[n] = x[i]; y[n] = y[i]; vx[n] = vx[i]; vy[n] = vy[i]; t[n] = t[i]; rate[n] = rate[i];
+			n++;
+		}
+		count = n;
+	}
+
+	void Draw()
+	{
+		if (!count) return;
+		srf.BatchRenderBegin(true);
+		for (int i = 0; i != count; i++)
+		{
+			scalar scale = 0.03f - 0.02f * t[i];
+			srf.Draw(x[i], y[i], 0, scale, scale, ZLLUMA(1, 1 - t[i]));
+		}
+		srf.BatchRenderEnd();
+	}
+} sparks;
+
+//Only what the title needs is loaded before the first frame, the rest follows on the main thread one step per frame once the title is shown:
+//the sprites and then one sound each, the music starts after the last sound so the synth never renders samples while it plays
+enum { LOAD_SPRITES, LOAD_SOUNDS, LOAD_DONE = LOAD_SOUNDS + 4 };
+static int loadstep;
+static bool loaded;
+static double launchtime = ProfileTime(), startupframe, startuploaded, startupsounds; //microseconds
+
+//Desktop builds read the images and the font from DepotMania.pack when it exists (built by make pack), next to the executable
+//or else in the current directory where Data is
+//It stays mapped for the whole run and the assets are read straight out of the mapping, the font is stored uncompressed
+//and the PNGs hold their pixels in stored deflate blocks
+//Layout: "DMP1", entry count, the entries with name, offset and size, then the files at 16 byte aligned offsets
+struct SPackEntry { char name[24]; unsigned int offset, size; };
+struct SPackHeader { char magic[4]; unsigned int count; SPackEntry entries[1]; };
+static SMappedFile assetpack;
+
+static bool OpenAssetPack(const char* path)
+{
+	if (!assetpack.Open(path)) return false;
+	const SPackHeader* hdr = (const SPackHeader*)assetpack.data;
+	if (assetpack.size < sizeof(SPackHeader) || memcmp(hdr->magic, "DMP1", 4) || hdr->count > (assetpack.size - 8) / sizeof(SPackEntry)) { assetpack.Close(); return false; }
+	for (unsigned int i = 0; i != hdr->count; i++)
+		if ((size_t)hdr->entries[i].offset + hdr->entries[i].size > assetpack.size) { assetpack.Close(); return false; }
+	return true;
+}
+
+//Path of DepotMania.pack in the directory of the executable, empty where the executable can't be found
+static ZL_String ExecutablePackPath()
+{
+	char path[1024];
+	#ifdef _WIN32
+	DWORD n = GetModuleFileNameA(NULL, path, sizeof(path));
+	if (n == 0 || n == sizeof(path)) return ZL_String();
+	#else
+	ssize_t n = readlink("/proc/self/exe", path, sizeof(path));
+	if (n <= 0 || n == sizeof(path)) return ZL_String();
+	#endif
+	while (n && path[n - 1] != '/' && path[n - 1] != '\\') n--;
+	path[n] = '\0';
+	return ZL_String(path) + "DepotMania.pack";
+}
+
+static const SPackEntry* AssetEntry(const char* packname)
+{
+	const SPackHeader* hdr = (const SPackHeader*)assetpack.data;
+	if (hdr) for (unsigned int i = 0; i != hdr->count; i++)
+		if (!strncmp(hdr->entries[i].name, packname, sizeof(hdr->entries[i].name))) return &hdr->entries[i];
+	return NULL;
+}
+
+static ZL_File AssetFile(const char* packname, const char* path)
+{
+	const SPackEntry* entry = AssetEntry(packname);
+	return (entry ? ZL_File(assetpack.data + entry->offset, entry->size) : ZL_File(path));
+}
+
+//The font file is looked up (and without the pack inflated) once and both sizes are built from the same bytes
+static void LoadFonts(ZL_Font& main, ZL_Font& big)
+{
+	static ZL_String unpacked;
+	const SPackEntry* entry = AssetEntry("typomoderno.ttf");
+	if (!entry && unpacked.empty()) unpacked = ZL_File("Data/typomoderno.ttf.zip").GetContents();
+	const void* data = (entry ? (const void*)(assetpack.data + entry->offset) : (const void*)unpacked.c_str());
+	size_t size = (entry ? entry->size : unpacked.length());
+	main = ZL_Font(ZL_File(data, size), 30.0f);
+	big = ZL_Font(ZL_File(data, size), 100.0f);
+}
+
+static double ResidentMemory(bool peak = false) //megabytes, peak is the high-water mark of the process
+{
+	#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	return (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? (peak ? pmc.PeakWorkingSetSize : pmc.WorkingSetSize) / (1024.0 * 1024.0) : 0);
+	#else
+	long kb = 0;
+	char line[128];
+	FILE* f = fopen("/proc/self/status", "r");
+	while (f && fgets(line, sizeof(line), f))
+		if (!strncmp(line, (peak ? "VmHWM:" : "VmRSS:"), 6)) { kb = atol(line + 6); break; }
+	if (f) fclose(f);
+	return kb / 1024.0;
+	#endif
+}
+
+static void LoadSound(int i)
+{
+	static ZL_Sound* const sounds[] = { &sndPickup, &sndDrop, &sndCheck, &sndStar };
+	#ifdef DEPOTMANIA_PRERENDERED_AUDIO
+	static const char* const files[] = { "Data/pickup.ogg", "Data/drop.ogg", "Data/check.ogg", "Data/star.ogg" };
+	*sounds[i] = ZL_Sound(files[i]);
+	#else
+	static TImcSongData* const songs[] = { &imcDataIMCPICKUP, &imcDataIMCDROP, &imcDataIMCCHECK, &imcDataIMCSTAR };
+	*sounds[i] = ZL_SynthImcTrack::LoadAsSample(songs[i]);
+	#endif
+}
+
+static void Load()
+{
+	ZL_String packpath = ExecutablePackPath();
+	if (packpath.empty() || !OpenAssetPack(packpath.c_str())) OpenAssetPack("DepotMania.pack");
+	srfFloor = ZL_Surface(AssetFile("floor.png", "Data/floor.png")).SetTextureRepeatMode();
+	srfFloor.SetScale(1.0f/srfFloor.GetWidth(), 1.0f/srfFloor.GetHeight());
+	srfWall = ZL_Surface(AssetFile("wall.png", "Data/wall.png")).SetTextureRepeatMode();
+	srfWall.SetScale(1.0f/srfWall.GetWidth(), 1.0f/srfFloor.GetHeight());
+
+	LoadFonts(fntMain, fntBig);
+	txtItems = SCachedText(fntMain, ZL_String::format("Items: %d/%d", game.nitems, game.itemtypes).c_str(), 1, ZLWHITE, 0, 3);
+	txtScore = SCachedText(fntMain, ZL_String::format("Score: %d", game.score).c_str(), 1, ZLWHITE, 0, 3);
+	txtExpansion = SCachedText(fntMain, ZL_String::format("Upgrade In: %d", game.expansion).c_str(), 1, ZLWHITE, 0, 3);
+
+	#ifdef DEPOTMANIA_PRERENDERED_AUDIO
+	sndMusic = ZL_Sound(ZL_File("Data/music.ogg"), true);
+	sndMusic.Play(true);
+	#endif
+
+	title = true;
+}
+
+static void LoadSprites()
+{
+	//Data/atlas.png is built by Assets/packatlas.py, 32x32 tiles with the items at 0-15, player at 16-17/20-21, check 18, star 19, spark 22
+	srfGFX = ZL_Surface(AssetFile("atlas.png", "Data/atlas.png")).SetTilesetClipping(4, 6).SetOrigin(ZL_Origin::Center);
+	srfPlayer = srfGFX.Clone().SetTilesetClipping(2, 3).SetTilesetIndex(4).SetScale(0.02f);
+	srfCheck = srfGFX.Clone().SetTilesetIndex(18);
+	srfStar = srfGFX.Clone().SetTilesetIndex(19);
+
+	sparks.srf = srfGFX.Clone().SetTilesetIndex(22);
+}
+
+static bool LoadPoll(bool wait)
+{
+	static int polls;
+	if (loaded) return true;
+	if (!wait && !polls++) return false; //the first frame has not been presented yet
+	for (bool first = true; loadstep != LOAD_DONE && (first || wait); first = false, loadstep++)
+	{
+		double t = ProfileTime();
+		if (loadstep == LOAD_SPRITES) { startupframe = t - launchtime; LoadSprites(); }
+		else { LoadSound(loadstep - LOAD_SOUNDS); startupsounds += ProfileTime() - t; }
+	}
+	if (loadstep != LOAD_DONE) return false;
+	#ifndef DEPOTMANIA_PRERENDERED_AUDIO
+	imcMusic.Play();
+	#endif
+	loaded = true;
+	startuploaded = ProfileTime() - launchtime;
+	printf("Startup: first frame after %.1f ms, all assets loaded after %.1f ms (sounds %.1f ms), %.1f MB resident, images and font from %s\n",
+		startupframe / 1000, startuploaded / 1000, startupsounds / 1000, ResidentMemory(), (assetpack.data ? "DepotMania.pack" : "Data"));
+	return true;
+}
+
+void SWorld::SetRoom(int _level)
+{
+	if (stress.size)
+	{
+		//the stress room never grows, all item types are in play from the start
+		level = _level;
+		nitems = itemtypes;
+		tickPerBox = stress.tickPerBox;
+		expansion = 0x3FFFFFFF;
+		events.room = true;
+		BuildRoom();
+		Telemetry(this, TELEMETRY_ROOM, level, grid.w, grid.h);
+		return;
+	}
+	int h = 3 + _level / 4, w = h + ((_level % 4) / 2);
+	expansion += (w*h)-5;
+	if (expansion <= 0) { SetRoom(_level + 1); return; }
+
+	level = _level;
+	nitems = ZL_Math::Min(2 + _level, itemtypes);
+	tickPerBox = (level == 0 ? 3500 : (level == 1 ? 3000 : (level == 2 ? 2600 : 2200)));
+	events.room = true;
+	BuildRoom();
+	Telemetry(this, TELEMETRY_ROOM, level, grid.w, grid.h);
+}
+
+//Sets up the walls, broadphase and grid for the room size of the current level
+void SWorld::BuildRoom()
+{
+	int h = 3 + level / 4, w = h + ((level % 4) / 2);
+	if (stress.size) w = h = (stress.size + 2) / 2;
+	room = cpBBNew(-w+.5f, -h+.5f, w-.5f, h-.5f);
+	if (roombody) RemoveBody(roombody);
+	if (broadphase == BROADPHASE_HASH && hashcells != (2*w+1)*(2*h+1)*10)
+	{
+		//about 10 hash cells per room cell (walls included), rebuilt with all current shapes whenever the room grows
+		hashcells = (2*w+1)*(2*h+1)*10;
+		SMemTag tag(MEM_INDEX);
+		cpSpaceUseSpatialHash(space, 1.0f, hashcells);
+	}
+	roombody = AddBody(space, NewBody(999999999.f, INFINITY));
+	cpBodySetVelocityUpdateFunc(roombody, FixVelocityFunc);
+	cpBodySetPositionUpdateFunc(roombody, FixUpdatePositionFunc);
+	AddShape(space, NewBoxShape(roombody, cpBBNew(room.l-1.f, room.t, room.r+1.f, room.t+1.f), 0));
+	AddShape(space, NewBoxShape(roombody, cpBBNew(room.l-1.f, room.b-1.f, room.r+1.f, room.b), 0));
+	AddShape(space, NewBoxShape(roombody, cpBBNew(room.l-1.f, room.b-1.f, room.l, room.t+1.f), 0));
+	AddShape(space, NewBoxShape(roombody, cpBBNew(room.r, room.b-1.f, room.r+1.f, room.t+1.f), 0));
+	GridReset();
+}
+
+void SWorld::Free()
+{
+	if (!space) return;
+	#ifdef DEPOTMANIA_HASTY
+	if (hasty) cpHastySpaceFree(space); else
+	#endif
+	cpSpaceFree(space); //touches the bodies, so they go after
+	space = NULL;
+	cpBody* owned[] = { player.body, player2.body, roombody }; //the only bodies not in the pools
+	for (cpBody* body : owned)
+	{
+		if (!body) continue;
+		for (cpShape *shp = body->shapeList, *next; shp; shp = next) { next = shp->next; cpShapeFree(shp); }
+		cpBodyFree(body);
+	}
+	player.body = player2.body = roombody = NULL;
+	boxfree.clear();
+	jointfree.clear();
+	live.clear();
+	for (SBox& box : boxstore) boxfree.push_back(&box);
+	for (cpPinJoint& joint : jointstore) jointfree.push_back(&joint);
+}
+
+cpSpace* SWorld::NewSpace(bool _hasty)
+{
+	#ifdef DEPOTMANIA_HASTY
+	cpSpace* spc = (_hasty ? cpHastySpaceNew() : cpSpaceNew());
+	if (_hasty) cpHastySpaceSetThreads(spc, solverthreads);
+	#else
+	(void)_hasty;
+	cpSpace* spc = cpSpaceNew();
+	#endif
+	cpSpaceSetUserData(spc, this);
+	cpSpaceSetIterations(spc, solveriterations);
+	cpSpaceSetDamping(spc, 0.0001f);
+	cpSpaceSetCollisionSlop(spc, .0001f); //Defaults to 0.1.
+	if (hashcells) { SMemTag tag(MEM_INDEX); cpSpaceUseSpatialHash(spc, 1.0f, hashcells); }
+	return spc;
+}
+
+//Moves all bodies, shapes and constraints over to a new space with or without the threaded solver, only called between steps
+void SWorld::SetHasty(bool enable)
+{
+	#ifdef DEPOTMANIA_HASTY
+	if (enable == hasty) return;
+	std::vector<cpBody*> bodies;
+	std::vector<cpShape*> shapes;
+	std::vector<cpConstraint*> constraints;
+	cpSpaceEachBody(space, [](cpBody* b, void* v) { ((std::vector<cpBody*>*)v)->push_back(b); }, &bodies);
+	cpSpaceEachShape(space, [](cpShape* s, void* v) { ((std::vector<cpShape*>*)v)->push_back(s); }, &shapes);
+	cpSpaceEachConstraint(space, [](cpConstraint* c, void* v) { ((std::vector<cpConstraint*>*)v)->push_back(c); }, &constraints);
+	for (cpConstraint* c : constraints) cpSpaceRemoveConstraint(space, c);
+	for (cpShape* shp : shapes) cpSpaceRemoveShape(space, shp);
+	for (cpBody* b : bodies) cpSpaceRemoveBody(space, b);
+	(hasty ? cpHastySpaceFree(space) : cpSpaceFree(space));
+	hasty = enable;
+	space = NewSpace(hasty);
+	for (cpBody* b : bodies) AddBody(space, b);
+	for (cpShape* shp : shapes) AddShape(space, shp);
+	for (cpConstraint* c : constraints) AddConstraint(space, c);
+	#else
+	(void)enable;
+	#endif
+}
+
+void SWorld::Init(unsigned int _seed, int players)
+{
+	Free();
+	roombody = spawnboxbody = NULL;
+	boxes = hashcells = 0;
+	hasty = false;
+	space = NewSpace(false);
+
+	player.body = AddBody(space, NewBody(1, cpMomentForCircle(1, 0, 0.5f, cpvzero)));
+	player.body->a = player.angle = player.preva = -PIHALF;
+	player.prevp = cpvzero;
+	player.mainshape = AddShape(space, NewCircleShape(player.body, 0.5f, cpvzero));
+	player.grabshape = AddShape(space, NewCircleShape(player.body, 0.4f, cpv(0.4f, 0)));
+	cpShapeSetFilter(player.grabshape, CP_SHAPE_FILTER_NONE);
+	if (players > 1)
+	{
+		player2.body = AddBody(space, NewBody(1, cpMomentForCircle(1, 0, 0.5f, cpvzero)));
+		player2.body->p = player2.prevp = cpv(1, 0);
+		player2.body->a = player2.angle = player2.preva = -PIHALF;
+		player2.mainshape = AddShape(space, NewCircleShape(player2.body, 0.5f, cpvzero));
+		player2.grabshape = AddShape(space, NewCircleShape(player2.body, 0.4f, cpv(0.4f, 0)));
+		cpShapeSetFilter(player2.grabshape, CP_SHAPE_FILTER_NONE);
+	}
+
+	score = expansion = 0;
+	tickNextBox = 3000;
+	tickNextDrop = (stress.size ? stress.tickPerBox : 0);
+	itemtypes = (stress.size ? stress.items : ITEM_TILES);
+	gameover = win = false;
+	seed = randstate = _seed;
+	recording.clear();
+
+	memset(itemgoals, 0, sizeof(itemgoals));
+	for (int i = 0; i != ITEM_TILES; i++)
+	{
+		idxretry:
+		itemindices[i] = (unsigned char)GameRand(0, ITEM_TILES-1);
+		for (int j = 0; j != i; j++) if (itemindices[i] == itemindices[j]) goto idxretry;
+	}
+	for (int i = ITEM_TILES; i != itemtypes; i++) itemindices[i] = itemindices[i % ITEM_TILES];
+
+	SetRoom();
+	itemNextBox = GameRand(0, nitems-1);
+}
+
+//Tint of an item tile, white for the first 16 item types and a different hue for every further set of 16
+static ZL_Color ItemColor(int item)
+{
+	return (item < ITEM_TILES ? ZLWHITE : ZL_Color::HSVA((item / ITEM_TILES) * 0.29f, 0.6f, 1.0f));
+}
+
+//Box quads are gathered from the physics polys once per frame and then drawn in three passes so the tiles go out in a single batch
+//Time since the last physics step as a fraction of a step, bodies are drawn this far between their previous and current state
+static scalar renderalpha = 1;
+enum { MAX_SUBSTEPS = 8 }; //physics steps per frame at most, time beyond that is dropped instead of catching up
+
+struct SBoxQuad { ZL_Vector v[4]; int item, tile; bool carried; };
+static std::vector<SBoxQuad> boxquads;
+
+static void DrawBoxes()
+{
+	boxquads.clear();
+	for (const SWorld::SBox* box : game.live)
+	{
+		const cpPolyShape* poly = &box->shape;
+		cpVect p = cpvlerp(box->prevp, box->body.p, renderalpha), rot = cpvforangle(box->preva + (box->body.a - box->preva) * renderalpha);
+		SBoxQuad q;
+		for (int i = 0; i != 4; i++) q.v[i] = cpvadd(p, cpvrotate(poly->planes[poly->count + i].v0, rot)); //untransformed verts follow the world ones
+		q.item = box->item;
+		q.tile = game.itemindices[q.item];
+		q.carried = !!box->body.constraintList;
+		boxquads.push_back(q);
+	}
+
+	ZL_Vector off = ZLV(0.05f, -0.05f);
+	for (const SBoxQuad& q : boxquads)
+		ZL_Display::FillQuad(off+q.v[0], off+q.v[1], off+q.v[2], off+q.v[3], (q.carried ? ZLRGBA(1,1,0,0.5f) : ZLLUMA(0, 0.5f)));
+	bool tinted = (game.itemtypes > ITEM_TILES);
+	srfGFX.BatchRenderBegin(tinted);
+	for (const SBoxQuad& q : boxquads)
+	{
+		srfGFX.SetTilesetIndex(q.tile);
+		if (tinted) srfGFX.DrawQuad(q.v[0], q.v[1], q.v[2], q.v[3], ItemColor(q.item));
+		else srfGFX.DrawQuad(q.v[0], q.v[1], q.v[2], q.v[3]);
+	}
+	srfGFX.BatchRenderEnd();
+	for (const SBoxQuad& q : boxquads)
+		ZL_Display::DrawQuad(q.v[0], q.v[1], q.v[2], q.v[3], (q.carried ? ZL_Color::Yellow : ZLBLACK));
+}
+
+
+//Moves and turns a player and grabs or drops the box in front of it
+void SWorld::TickPlayer(SPlayer& p, const SInput& in)
+{
+	ZL_Vector inp = ZLV(in.x, in.y);
+	bool grab = in.grab, strafe = in.strafe;
+
+	cpBodySetForce(p.body, cpv(inp.x*50, inp.y*50));
+
+	if (!!inp && !strafe) p.angle = inp.GetAngle();
+	float rel = ZL_Math::RelAngle(cpBodyGetAngle(p.body), p.angle);
+	cpBodySetAngularVelocity(p.body, rel*10);
+
+	if (grab && !p.body->constraintList)
+	{
+		cpShapeSetFilter(p.grabshape, CP_SHAPE_FILTER_ALL);
+		cpSpaceShapeQuery(space, p.grabshape, [](cpShape *shape, cpContactPointSet *points, void *data)
+		{
+			if (!shape->body->userData) return;
+			SWorld* w = (SWorld*)cpSpaceGetUserData(shape->space);
+			SPlayer& player = *(SPlayer*)data;
+
+			//cpVect mid = cpvlerp(points->points[0].pointA, points->points[0].pointB, 0.5f);
+			cpVect off = cpvmult(cpvperp(cpvnormalize(cpvsub(shape->body->p, player.body->p))), 0.1f);
+			cpConstraint * c1 = w->NewJoint(player.body, shape->body, cpvadd(cpv(0.4f, 0), cpBodyWorldToLocal(player.body, cpvadd(player.body->p, off))), cpBodyWorldToLocal(shape->body, cpvadd(shape->body->p, off)));
+			off = cpvneg(off);
+			cpConstraint * c2 = w->NewJoint(player.body, shape->body, cpvadd(cpv(0.4f, 0), cpBodyWorldToLocal(player.body, cpvadd(player.body->p, off))), cpBodyWorldToLocal(shape->body, cpvadd(shape->body->p, off)));
+
+			cpSpaceAddPostStepCallback(shape->space, [](cpSpace *space, void *key, void *data) { AddConstraint(space, (cpConstraint *)key); }, c1, NULL);
+			cpSpaceAddPostStepCallback(shape->space, [](cpSpace *space, void *key, void *data) { AddConstraint(space, (cpConstraint *)key); }, c2, NULL);
+
+		}, &p);
+		cpShapeSetFilter(p.grabshape, CP_SHAPE_FILTER_NONE);
+		if (p.body->constraintList)
+		{
+			events.pickup = true;
+			Telemetry(this, TELEMETRY_GRAB, (&p == &player2), ((SBox*)p.body->constraintList->b)->item);
+		}
+	}
+	if (!grab && p.body->constraintList)
+	{
+		Telemetry(this, TELEMETRY_DROP, (&p == &player2), ((SBox*)p.body->constraintList->b)->item);
+		while (cpConstraint* c = p.body->constraintList) { cpSpaceRemoveConstraint(space, c); FreeJoint(c); }
+		events.drop = true;
+	}
+}
+
+//Advances the simulation by one fixed 16 ms step, in2 is the input of the second player in co-op games
+void SWorld::Tick(const SInput& in, const SInput& in2)
+{
+	recording.push_back(EncodeInput(in));
+	if (player2.body) recording.push_back(EncodeInput(in2));
+	TickPlayer(player, in);
+	if (player2.body) TickPlayer(player2, in2);
+
+	tickNextBox -= 16;
+	if (!spawnboxbody && tickNextBox <= 0)
+	{
+		spawnboxbody = AddBox(itemNextBox, cpv(0, room.b+.01f), .01f);
+		Telemetry(this, TELEMETRY_SPAWN, itemNextBox, 0, 0, 0, (float)(room.b+.01f));
+	}
+	if (spawnboxbody)
+	{
+		float f = ZL_Math::Min(-tickNextBox / 1000.0f, 1.0f);
+
+		cpBB bb = cpBBNewForCircle(cpvzero, (.01f + .9f * f) * 0.5f);
+		cpVect verts[] = { {bb.r, bb.b}, {bb.r, bb.t}, {bb.l, bb.t}, {bb.l, bb.b}, };
+		cpPolyShapeSetVerts(spawnboxbody->shapeList, 4, verts, cpTransformIdentity);
+
+		if (f == 1.0)
+		{
+			spawnboxbody = NULL;
+			tickNextBox = tickPerBox;
+			itemNextBox = GameRand(0, nitems-1);
+		}
+	}
+	if (stress.spawners > 1 && (tickNextDrop -= 16) <= 0)
+	{
+		//the extra stress spawn points drop a full box into their cell on the top row unless something is in the way
+		tickNextDrop = tickPerBox;
+		for (int i = 0, n = stress.spawners - 1; i != n; i++)
+		{
+			cpVect p = cpv(room.l + .5f + (2 * i + 1) * grid.w / (2 * n), room.t - .5f);
+			if (cpSpacePointQueryNearest(space, p, .45f, CP_SHAPE_FILTER_ALL, NULL)) continue;
+			int item = GameRand(0, nitems-1);
+			AddBox(item, p, .91f);
+			Telemetry(this, TELEMETRY_SPAWN, item, 0, 0, (float)p.x, (float)p.y);
+		}
+	}
+
+	//Spawns, grabs and drops all happened above so the grid rebuilt by MoveBoxes includes them
+	grid.aligned.swap(grid.lastaligned);
+	grid.loose.swap(grid.lastloose);
+	std::fill(grid.aligned.begin(), grid.aligned.end(), 0);
+	std::fill(grid.loose.begin(), grid.loose.end(), 0);
+	double t = ProfileTime();
+	SMemTag tag(MEM_ARBITERS);
+	MoveBoxes(s(16.0/1000.0));
+	#ifdef DEPOTMANIA_HASTY
+	if (hasty) cpHastySpaceStep(space, s(16.0/1000.0)); else
+	#endif
+	cpSpaceStep(space, s(16.0/1000.0));
+	MemRetagIndex(space->dynamicShapes, hashcells != 0);
+	prof.step += ProfileTime() - t;
+	for (size_t i = 0, n = grid.dirty.size(); i != n; i++)
+	{
+		uint64_t d = (grid.aligned[i] ^ grid.lastaligned[i]) | (grid.loose[i] ^ grid.lastloose[i]);
+		if (d) { grid.dirty[i] |= d; grid.anydirty = true; }
+	}
+}
+
+//Clears all groups of matching items found after the last steps and checks for game over
+void SWorld::Match()
+{
+	double t = ProfileTime();
+	if (grid.anydirty)
+	{
+		GridFindClusters();
+		std::fill(grid.dirty.begin(), grid.dirty.end(), 0);
+		grid.anydirty = false;
+	}
+	else clusters.clear();
+
+	for (const SCluster& c : clusters)
+	{
+		int area = (int)c.count;
+		int item = c.item;
+		for (size_t i = c.first; i != c.first + c.count; i++)
+		{
+			events.sparks.push_back(found[i]->p);
+			RemoveBody(found[i]);
+		}
+
+		bool newclear = (itemgoals[item] == 0);
+		itemgoals[item] |= ((area >= 6) ? 3 : 1);
+		((area >= 6) ? events.star : events.check) = true;
+		if (newclear)
+		{
+			bool allclear = true;
+			for (int i = 0; i != itemtypes; i++)
+				if (!itemgoals[i]) { allclear = false; break; }
+			if (allclear) win = true;
+		}
+
+		score += area;
+		expansion -= area;
+		events.score = true;
+		Telemetry(this, TELEMETRY_CLEAR, item, area, score);
+		if (expansion <= 0) SetRoom(level + 1);
+	}
+
+	if (!gameover && boxes > (room.r - room.l)*(room.t - room.b)-1)
+	{
+		gameover = true;
+		Telemetry(this, TELEMETRY_GAMEOVER, score, level, boxes);
+	}
+	if (solverthreads && hasty != (boxes > (hasty ? hastyboxes * 3 / 4 : hastyboxes))) SetHasty(!hasty);
+	prof.match += ProfileTime() - t;
+}
+
+void SWorld::StorePrevious()
+{
+	player.prevp = player.body->p;
+	player.preva = player.body->a;
+	if (player2.body) { player2.prevp = player2.body->p; player2.preva = player2.body->a; }
+	for (SBox* box : live) { box->prevp = box->body.p; box->preva = box->body.a; }
+}
+
+void SWorld::ResetEvents()
+{
+	events.pickup = events.drop = events.check = events.star = events.score = events.room = false;
+	events.sparks.clear();
+}
+
+//World snapshots are the game values, the player and every box with its item and motion and the grab joints, all as raw binary
+//Restoring keeps the space and only swaps the boxes, but contact impulses chipmunk carries between steps are not part of it
+//so a restored world can drift apart from the original run over time
+struct SStateBody { cpVect p, v; cpFloat a, w; };
+struct SStateBox { SStateBody body; int item; };
+struct SStateJoint { int player, box; cpVect anchorA, anchorB; cpFloat dist; };
+struct SStateHeader
+{
+	char magic[4];
+	unsigned int ticks, seed, randstate;
+	int level, nitems, itemtypes, score, expansion, itemNextBox, tickNextBox, tickPerBox, tickNextDrop, boxes, joints, spawnbox;
+	unsigned char itemindices[ITEMS_MAX], itemgoals[ITEMS_MAX];
+	bool gameover, win;
+	int players;
+	cpFloat angle, angle2;
+	SStateBody player, player2;
+};
+
+static SStateBody GetStateBody(cpBody* body)
+{
+	SStateBody s = { body->p, body->v, body->a, body->w };
+	return s;
+}
+
+static void SetStateBody(cpBody* body, const SStateBody& s)
+{
+	cpBodySetPosition(body, s.p);
+	cpBodySetVelocity(body, s.v);
+	cpBodySetAngle(body, s.a);
+	cpBodySetAngularVelocity(body, s.w);
+}
+
+void SWorld::SaveState(std::vector<unsigned char>& out)
+{
+	std::vector<cpBody*> bodies;
+	std::vector<cpConstraint*> joints;
+	cpSpaceEachBody(space, [](cpBody* b, void* v) { if (b->userData) ((std::vector<cpBody*>*)v)->push_back(b); }, &bodies); //space order so a restore adds them back the same way
+	cpBodyEachConstraint(player.body, [](cpBody*, cpConstraint* c, void* v) { ((std::vector<cpConstraint*>*)v)->push_back(c); }, &joints);
+	size_t joints1 = joints.size();
+	if (player2.body) cpBodyEachConstraint(player2.body, [](cpBody*, cpConstraint* c, void* v) { ((std::vector<cpConstraint*>*)v)->push_back(c); }, &joints);
+
+	SStateHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "DMS3", 4);
+	hdr.ticks = (unsigned int)recording.size();
+	hdr.seed = seed;
+	hdr.randstate = randstate;
+	hdr.level = level; hdr.nitems = nitems; hdr.itemtypes = itemtypes; hdr.score = score; hdr.expansion = expansion;
+	hdr.itemNextBox = itemNextBox; hdr.tickNextBox = tickNextBox; hdr.tickPerBox = tickPerBox; hdr.tickNextDrop = tickNextDrop;
+	hdr.boxes = (int)bodies.size();
+	hdr.joints = (int)joints.size();
+	hdr.spawnbox = (int)(std::find(bodies.begin(), bodies.end(), spawnboxbody) - bodies.begin());
+	if (hdr.spawnbox == hdr.boxes) hdr.spawnbox = -1;
+	memcpy(hdr.itemindices, itemindices, sizeof(itemindices));
+	memcpy(hdr.itemgoals, itemgoals, sizeof(itemgoals));
+	hdr.gameover = gameover;
+	hdr.win = win;
+	hdr.angle = player.angle;
+	hdr.player = GetStateBody(player.body);
+	hdr.players = (player2.body ? 2 : 1);
+	if (player2.body) { hdr.angle2 = player2.angle; hdr.player2 = GetStateBody(player2.body); }
+
+	out.assign(sizeof(hdr) + bodies.size() * sizeof(SStateBox) + joints.size() * sizeof(SStateJoint), 0); //zeroed padding so equal worlds give equal bytes
+	memcpy(&out[0], &hdr, sizeof(hdr));
+	SStateBox* box = (SStateBox*)&out[sizeof(hdr)];
+	for (cpBody* b : bodies) { box->body = GetStateBody(b); box->item = ((SBox*)b)->item; box++; }
+	SStateJoint* joint = (SStateJoint*)box;
+	for (size_t i = 0; i != joints.size(); i++)
+	{
+		cpPinJoint* pin = (cpPinJoint*)joints[i];
+		SStateJoint sj = { (i < joints1 ? 0 : 1), (int)(std::find(bodies.begin(), bodies.end(), joints[i]->b) - bodies.begin()), pin->anchorA, pin->anchorB, pin->dist };
+		*joint++ = sj;
+	}
+}
+
+bool SWorld::LoadState(const unsigned char* data, size_t size)
+{
+	SStateHeader hdr;
+	if (size < sizeof(hdr)) return false;
+	memcpy(&hdr, data, sizeof(hdr));
+	if (memcmp(hdr.magic, "DMS3", 4) || size != sizeof(hdr) + hdr.boxes * sizeof(SStateBox) + hdr.joints * sizeof(SStateJoint)) return false;
+	if (!space || hdr.players != (player2.body ? 2 : 1)) Init(hdr.seed, hdr.players);
+
+	while (!live.empty()) RemoveBody(&live.back()->body); //also takes the grab joints
+	std::vector<cpBody*> bodies;
+
+	bool newroom = (hdr.level != level || hdr.itemtypes != itemtypes || !roombody);
+	itemtypes = hdr.itemtypes;
+	recording.resize(hdr.ticks);
+	seed = hdr.seed;
+	randstate = hdr.randstate;
+	level = hdr.level; nitems = hdr.nitems; score = hdr.score; expansion = hdr.expansion;
+	itemNextBox = hdr.itemNextBox; tickNextBox = hdr.tickNextBox; tickPerBox = hdr.tickPerBox; tickNextDrop = hdr.tickNextDrop;
+	memcpy(itemindices, hdr.itemindices, sizeof(itemindices));
+	memcpy(itemgoals, hdr.itemgoals, sizeof(itemgoals));
+	gameover = hdr.gameover;
+	win = hdr.win;
+	player.angle = hdr.angle;
+	SetStateBody(player.body, hdr.player);
+	player.prevp = hdr.player.p;
+	player.preva = hdr.player.a;
+	if (player2.body)
+	{
+		player2.angle = hdr.angle2;
+		SetStateBody(player2.body, hdr.player2);
+		player2.prevp = hdr.player2.p;
+		player2.preva = hdr.player2.a;
+	}
+	if (newroom) BuildRoom();
+	else GridReset();
+
+	const SStateBox* box = (const SStateBox*)(data + sizeof(hdr));
+	bodies.clear();
+	for (int i = 0; i != hdr.boxes; i++, box++)
+	{
+		cpFloat size = (i == hdr.spawnbox ? .01f + .9f * ZL_Math::Min(-tickNextBox / 1000.0f, 1.0f) : .91f);
+		bodies.push_back(AddBox(box->item, box->body.p, ZL_Math::Max(size, (cpFloat).01f)));
+		SetStateBody(bodies.back(), box->body);
+		((SBox*)bodies.back())->preva = box->body.a;
+	}
+	spawnboxbody = (hdr.spawnbox >= 0 ? bodies[hdr.spawnbox] : NULL);
+	const SStateJoint* joint = (const SStateJoint*)box;
+	for (int i = 0; i != hdr.joints; i++, joint++)
+	{
+		cpConstraint* c = NewJoint((joint->player ? player2.body : player.body), bodies[joint->box], joint->anchorA, joint->anchorB);
+		cpPinJointSetDist(c, joint->dist);
+		AddConstraint(space, c);
+	}
+	events.room = newroom; //new floor and wall colours only for a different room, holding rewind restores a state every frame
+	events.score = true;
+	return true;
+}
+
+//The walls and the shadow gradients along them only change with the room, so they are drawn once into a surface that covers
+//the widest view until the camera has zoomed to the new room and then drawn as one quad on top of boxes and player
+static struct SRoomLayer { ZL_Surface srf; cpBB room; scalar ext, ar; int width, height; bool dirty; } roomlayer;
+
+//Plays and shows what happened in the simulation since the last frame
+static void ApplyEvents()
+{
+	if (game.events.pickup) sndPickup.Play();
+	if (game.events.drop) sndDrop.Play();
+	if (game.events.check) sndCheck.Play();
+	if (game.events.star) sndStar.Play();
+	sparks.Spawn(game.events.sparks);
+	if (game.events.room)
+	{
+		srfFloor.SetColor(ZL_Color::HSVA(RAND_FACTOR,0.5f,0.3f));
+		srfWall.SetColor(ZL_Color::HSVA(RAND_FACTOR,0.25f,0.3f));
+		roomlayer.dirty = true;
+		txtItems.Set(ZL_String::format("Items: %d/%d", game.nitems, game.itemtypes).c_str());
+		txtExpansion.Set(ZL_String::format("Upgrade In: %d", game.expansion).c_str());
+	}
+	if (game.events.score)
+	{
+		txtScore.Set(ZL_String::format("Score: %d", game.score).c_str());
+		txtExpansion.Set(ZL_String::format("Upgrade In: %d", game.expansion).c_str());
+	}
+	game.ResetEvents();
+}
+
+static void RenderRoomLayer(scalar sz, scalar ar)
+{
+	const cpBB& room = game.room;
+	scalar target = room.r + 1.0f;
+	roomlayer.room = room;
+	roomlayer.dirty = false;
+	roomlayer.ext = ZL_Math::Max(sz, target);
+	roomlayer.ar = ar;
+	roomlayer.width = ZL_Display::Width;
+	roomlayer.height = ZL_Display::Height;
+	int h = ZL_Math::Min((int)(ZL_Display::Height * roomlayer.ext / target + .5f), 4096), w = ZL_Math::Min((int)(h * ar + .5f), 4096);
+	if (!roomlayer.srf || roomlayer.srf.GetWidth() != w || roomlayer.srf.GetHeight() != h) roomlayer.srf = ZL_Surface(w, h, true);
+	roomlayer.srf.RenderToBegin(true, false);
+	ZL_Display::PushOrtho(-roomlayer.ext*ar, roomlayer.ext*ar, -roomlayer.ext, roomlayer.ext);
+	ZL_Display::FillGradient(room.l, room.t - .3f, room.r, room.t, ZLBLACK, ZLBLACK, ZLTRANSPARENT, ZLTRANSPARENT);
+	ZL_Display::FillGradient(room.l, room.b, room.l + .3f, room.t, ZLBLACK, ZLTRANSPARENT, ZLBLACK, ZLTRANSPARENT);
+	ZL_Display::FillGradient(room.l, room.b, room.r, room.b + .1f, ZLTRANSPARENT, ZLTRANSPARENT, ZLBLACK, ZLBLACK);
+	ZL_Display::FillGradient(room.r - .1f, room.b, room.r, room.t, ZLTRANSPARENT, ZLBLACK, ZLTRANSPARENT, ZLBLACK);
+	scalar e = roomlayer.ext*ar + 1.f;
+	srfWall.DrawTo(-e, room.t, e, e);
+	srfWall.DrawTo(-e, -e, e, room.b);
+	srfWall.DrawTo(-e, room.b, room.l, room.t);
+	srfWall.DrawTo(room.r, room.b, e, room.t);
+	ZL_Display::PopOrtho();
+	roomlayer.srf.RenderToEnd();
+}
+
+static void DrawRoomLayer(scalar sz, scalar ar)
+{
+	const cpBB& room = game.room;
+	if (!roomlayer.srf || roomlayer.dirty || memcmp(&roomlayer.room, &room, sizeof(cpBB)) || roomlayer.ar != ar || sz > roomlayer.ext
+		|| roomlayer.width != ZL_Display::Width || roomlayer.height != ZL_Display::Height) RenderRoomLayer(sz, ar);
+	roomlayer.srf.DrawTo(-roomlayer.ext*roomlayer.ar, -roomlayer.ext, roomlayer.ext*roomlayer.ar, roomlayer.ext);
+}
+
+//Snapshot of the game on screen every REWIND_TICKS ticks for about 6 seconds, every REWIND_GROUP-th one is stored whole as a keyframe
+//and the ones after it only as the runs of bytes that differ from it, holding Backspace steps back through them
+enum { REWIND_TICKS = 4, REWIND_GROUP = 16, REWIND_GROUPS = 6 };
+static struct SRewind { std::deque<std::vector<unsigned char> > frames; std::vector<unsigned char> cur; } rewindbuf;
+
+//Size, then pairs of unchanged and changed byte counts each followed by the changed bytes, short unchanged gaps are kept in the changed run
+static void DeltaEncode(const std::vector<unsigned char>& key, const std::vector<unsigned char>& cur, std::vector<unsigned char>& out)
+{
+	out.clear();
+	PutVarint(out, cur.size());
+	size_t n = cur.size(), k = key.size();
+	auto same = [&](size_t i) { return i < k && key[i] == cur[i]; };
+	for (size_t i = 0; i != n;)
+	{
+		size_t s = i, d;
+		while (s != n && same(s)) s++;
+		for (d = s; d != n; d++)
+			if (same(d) && (d + 4 > n || (same(d+1) && same(d+2) && same(d+3)))) break;
+		PutVarint(out, s - i);
+		PutVarint(out, d - s);
+		out.insert(out.end(), cur.begin() + s, cur.begin() + d);
+		i = d;
+	}
+}
+
+static bool DeltaDecode(const std::vector<unsigned char>& key, const std::vector<unsigned char>& delta, std::vector<unsigned char>& out)
+{
+	const unsigned char *p = delta.data(), *end = p + delta.size();
+	size_t size, s, d;
+	if (!GetVarint(p, end, size) || size > key.size() + delta.size()) return false; //every byte comes from one of them
+	out.resize(size);
+	for (size_t i = 0; i != size; i += d, p += d)
+	{
+		if (!GetVarint(p, end, s) || !GetVarint(p, end, d) || s > size - i || s > key.size() - ZL_Math::Min(i, key.size())) return false;
+		if (s) memcpy(&out[i], &key[i], s);
+		i += s;
+		if (d > size - i || d > (size_t)(end - p)) return false;
+		if (d) memcpy(&out[i], p, d);
+	}
+	return true;
+}
+
+static void RewindPush()
+{
+	game.SaveState(rewindbuf.cur);
+	if (rewindbuf.frames.size() == REWIND_GROUP * REWIND_GROUPS) rewindbuf.frames.erase(rewindbuf.frames.begin(), rewindbuf.frames.begin() + REWIND_GROUP);
+	size_t i = rewindbuf.frames.size();
+	if (i % REWIND_GROUP == 0) { rewindbuf.frames.push_back(rewindbuf.cur); return; }
+	rewindbuf.frames.push_back(std::vector<unsigned char>());
+	DeltaEncode(rewindbuf.frames[i - i % REWIND_GROUP], rewindbuf.cur, rewindbuf.frames.back());
+}
+
+static bool RewindPop()
+{
+	if (rewindbuf.frames.empty()) return false;
+	size_t i = rewindbuf.frames.size() - 1;
+	if (i % REWIND_GROUP == 0) rewindbuf.cur.swap(rewindbuf.frames[i]);
+	else if (!DeltaDecode(rewindbuf.frames[i - i % REWIND_GROUP], rewindbuf.frames[i], rewindbuf.cur)) { rewindbuf.frames.clear(); return false; }
+	rewindbuf.frames.pop_back();
+	return game.LoadState(&rewindbuf.cur[0], rewindbuf.cur.size());
+}
+
+//Two player co-op over UDP, both peers step an authoritative world in lockstep once the inputs of both players for a tick are known
+//The world on screen runs ahead on the local inputs and the last known input of the partner and is reset to the authoritative one
+//whenever that advances, restoring a snapshot can't bring back the cached contacts so only the predicted world ever gets restored
+//The socket is connected to the peer once it is known (right away when joining, on the first hello when hosting) so nothing else gets through
+enum { COOP_PORT = 7470, COOP_DELAY = 3, COOP_MAX_PREDICT = 12, COOP_MAX_SEND = 600, COOP_CHECK_TICKS = 60, COOP_RESEND = 100, COOP_TIMEOUT = 5000 };
+struct SCoop
+{
+	bool active, host, started, lost, won, desync;
+	SOCKET sock;
+	sockaddr_in peer;
+	int me, delay;
+	unsigned int seed;
+	ticks_t lastsend, lastrecv;
+	std::vector<unsigned char> inputs[2], state;
+	std::vector<unsigned int> checks[2]; //hashes of the authoritative world every COOP_CHECK_TICKS ticks, 0 while not known yet
+	size_t acked, confirmed, predicted;
+	SWorld world, *view = &game; //view is the predicted world on screen
+
+	bool Open(const char* address, unsigned short port, int delay);
+	void Close();
+	void Start(unsigned int seed);
+	void Send(const std::vector<unsigned char>& packet);
+	void SendInputs();
+	void Compare(size_t i);
+	bool ReceiveInputs(const unsigned char* p, const unsigned char* end);
+	void Receive();
+	unsigned char Input(int player, size_t tick);
+	void Advance();
+	void Frame(const SInput& in, ticks_t elapsed, ticks_t& ticksum);
+};
+static SCoop coop;
+
+static unsigned int CoopHash(const std::vector<unsigned char>& data)
+{
+	unsigned int h = 2166136261u;
+	for (unsigned char c : data) h = (h ^ c) * 16777619u;
+	return (h ? h : 1);
+}
+
+bool SCoop::Open(const char* address, unsigned short port, int _delay)
+{
+	#ifdef _WIN32
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa)) return false;
+	#endif
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == INVALID_SOCKET) return false;
+	memset(&peer, 0, sizeof(peer));
+	peer.sin_family = AF_INET;
+	peer.sin_port = htons(port);
+	if (address)
+	{
+		addrinfo hints, *res;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+		bool found = !getaddrinfo(address, NULL, &hints, &res);
+		if (found) { peer.sin_addr = ((sockaddr_in*)res->ai_addr)->sin_addr; freeaddrinfo(res); }
+		if (!found || connect(sock, (sockaddr*)&peer, sizeof(peer))) { Close(); return false; }
+	}
+	else
+	{
+		sockaddr_in any = peer;
+		any.sin_addr.s_addr = htonl(INADDR_ANY);
+		if (bind(sock, (sockaddr*)&any, sizeof(any))) { Close(); return false; }
+	}
+	#ifdef _WIN32
+	u_long nonblocking = 1;
+	ioctlsocket(sock, FIONBIO, &nonblocking);
+	#else
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+	#endif
+	active = true;
+	host = !address;
+	me = (address ? 1 : 0);
+	delay = ZL_Math::Clamp(_delay, 0, (int)COOP_MAX_PREDICT);
+	lastrecv = ZLTICKS;
+	return true;
+}
+
+void SCoop::Close()
+{
+	#ifdef _WIN32
+	closesocket(sock);
+	WSACleanup();
+	#else
+	close(sock);
+	#endif
+	sock = INVALID_SOCKET;
+}
+
+void SCoop::Start(unsigned int _seed)
+{
+	seed = _seed;
+	started = true;
+	world.Init(seed, 2);
+	view->Init(seed, 2);
+	//the first ticks of both players are neutral so the local input is only needed a few ticks later
+	unsigned char neutral = EncodeInput(SInput());
+	for (int i = 0; i != 2; i++) inputs[i].assign(delay, neutral);
+	acked = confirmed = predicted = 0;
+	if (view != &game) return;
+	rewindbuf.frames.clear();
+	playback.clear();
+}
+
+void SCoop::Send(const std::vector<unsigned char>& packet)
+{
+	send(sock, (const char*)&packet[0], (int)packet.size(), 0);
+	lastsend = ZLTICKS;
+}
+
+//'I' packets carry what the peer has of our inputs, then our inputs it doesn't have yet as runs of the same value, then the latest world hash
+void SCoop::SendInputs()
+{
+	const std::vector<unsigned char>& mine = inputs[me];
+	size_t first = acked, n = ZL_Math::Min(mine.size() - first, (size_t)COOP_MAX_SEND);
+	std::vector<unsigned char> packet(1, 'I');
+	PutVarint(packet, inputs[me ^ 1].size());
+	PutVarint(packet, first);
+	PutVarint(packet, n);
+	for (size_t i = first, run; i != first + n; i += run)
+	{
+		for (run = 1; i + run != first + n && mine[i + run] == mine[i]; run++) {}
+		PutVarint(packet, run);
+		packet.push_back(mine[i]);
+	}
+	size_t check = checks[me].size();
+	PutVarint(packet, check);
+	if (check) for (int i = 0; i != 4; i++) packet.push_back((unsigned char)(checks[me][check - 1] >> (i * 8)));
+	Send(packet);
+}
+
+void SCoop::Compare(size_t i)
+{
+	unsigned int a = (i < checks[0].size() ? checks[0][i] : 0), b = (i < checks[1].size() ? checks[1][i] : 0);
+	if (a && b && a != b && !desync) { desync = true; printf("Co-op worlds out of sync at tick %d\n", (int)((i + 1) * COOP_CHECK_TICKS)); }
+}
+
+//The whole packet is checked before any of it is used, it is dropped if a field is cut off, the runs don't add up to exactly n inputs,
+//the inputs leave a gap or the acknowledged inputs and the hash index are ahead of what we have sent
+bool SCoop::ReceiveInputs(const unsigned char* p, const unsigned char* end)
+{
+	std::vector<unsigned char>& theirs = inputs[me ^ 1];
+	size_t ack, first, n, run, check, total = 0;
+	if (!GetVarint(p, end, ack) || !GetVarint(p, end, first) || !GetVarint(p, end, n)) return false;
+	if (ack > inputs[me].size() || first > theirs.size() || n > COOP_MAX_SEND) return false;
+	const unsigned char* runs = p;
+	for (; total != n; total += run, p++)
+		if (!GetVarint(p, end, run) || !run || run > n - total || p == end) return false;
+	const unsigned char* runsend = p;
+	if (!GetVarint(p, end, check) || check > inputs[me].size() / COOP_CHECK_TICKS || (size_t)(end - p) != (check ? 4u : 0u)) return false;
+
+	if (ack > acked) acked = ack;
+	for (size_t i = first; runs != runsend; i += run, runs++)
+	{
+		GetVarint(runs, runsend, run);
+		for (size_t j = i; j != i + run; j++) if (j == theirs.size()) theirs.push_back(*runs);
+	}
+	if (check)
+	{
+		if (checks[me ^ 1].size() < check) checks[me ^ 1].resize(check, 0);
+		checks[me ^ 1][check - 1] = (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+		Compare(check - 1);
+	}
+	return true;
+}
+
+void SCoop::Receive()
+{
+	unsigned char buf[2048];
+	sockaddr_in from;
+	for (;;)
+	{
+		socklen_t fromlen = sizeof(from);
+		int len = (int)recvfrom(sock, (char*)buf, sizeof(buf), 0, (sockaddr*)&from, &fromlen);
+		if (len <= 0) break; //also a refused send to a peer that isn't listening yet
+		bool frompeer = (from.sin_addr.s_addr == peer.sin_addr.s_addr && from.sin_port == peer.sin_port);
+		const unsigned char *p = buf + 1, *end = buf + len;
+		size_t n;
+		if (buf[0] == 'H' && host && len == 1)
+		{
+			if (!started)
+			{
+				peer = from;
+				if (connect(sock, (sockaddr*)&peer, sizeof(peer))) continue;
+				Start((unsigned int)RAND_INT_MAX(0x7FFFFFFF));
+			}
+			else if (!frompeer) continue;
+			std::vector<unsigned char> packet(1, 'W');
+			PutVarint(packet, seed);
+			Send(packet);
+		}
+		else if (buf[0] == 'W' && !host && frompeer && GetVarint(p, end, n) && p == end)
+		{
+			if (!started) Start((unsigned int)n);
+		}
+		else if (buf[0] == 'I' && started && frompeer)
+		{
+			if (!ReceiveInputs(p, end)) continue;
+		}
+		else continue;
+		lastrecv = ZLTICKS;
+	}
+	if (started && ZLSINCE(lastrecv) > COOP_TIMEOUT) lost = true;
+}
+
+unsigned char SCoop::Input(int player, size_t tick)
+{
+	const std::vector<unsigned char>& in = inputs[player];
+	if (in.empty()) return EncodeInput(SInput());
+	return (tick < in.size() ? in[tick] : in.back()); //the partner is predicted to keep doing what it did last
+}
+
+void SCoop::Advance()
+{
+	bool advanced = false;
+	while (!world.gameover && confirmed < ZL_Math::Min(inputs[0].size(), inputs[1].size()))
+	{
+		world.Tick(DecodeInput(inputs[0][confirmed]), DecodeInput(inputs[1][confirmed]));
+		world.Match();
+		if (world.win) { world.win = false; won = true; } //the game goes on for both while the message is shown
+		advanced = true;
+		if (++confirmed % COOP_CHECK_TICKS) continue;
+		world.SaveState(state);
+		checks[me].push_back(CoopHash(state));
+		Compare(checks[me].size() - 1);
+	}
+
+	size_t target = inputs[me].size() - delay;
+	if (advanced)
+	{
+		world.SaveState(state);
+		view->LoadState(&state[0], state.size());
+		predicted = confirmed;
+	}
+	for (; predicted < target && !view->gameover; predicted++)
+	{
+		if (predicted + 1 == target) view->StorePrevious();
+		view->Tick(DecodeInput(Input(0, predicted)), DecodeInput(Input(1, predicted)));
+		view->Match();
+	}
+
+	//sounds, sparks and texts only follow what really happened
+	view->gameover = world.gameover;
+	view->win = won;
+	view->events = world.events;
+	world.ResetEvents();
+}
+
+void SCoop::Frame(const SInput& in, ticks_t elapsed, ticks_t& ticksum)
+{
+	Receive();
+	if (!started)
+	{
+		if (!host && ZLSINCE(lastsend) > 250) Send(std::vector<unsigned char>(1, 'H'));
+		ticksum = 0;
+		return;
+	}
+	size_t had = inputs[me].size();
+	for (ticksum += elapsed; ticksum > 16 && !world.gameover; ticksum -= 16)
+	{
+		if (view->prof.substeps == MAX_SUBSTEPS) { ticksum = 16; break; }
+		if (inputs[me].size() >= confirmed + delay + COOP_MAX_PREDICT) { ticksum = 16; break; } //too far ahead of the partner, wait
+		inputs[me].push_back(EncodeInput(in));
+		view->prof.substeps++;
+	}
+	//the frame rate is uncapped, so a packet only goes out for new ticks, otherwise now and then to resend what isn't acked yet,
+	//acknowledge the partner's inputs and keep the connection from timing out
+	if (inputs[me].size() != had || ZLSINCE(lastsend) > COOP_RESEND) SendInputs();
+	Advance();
+}
+
+//DepotMania -coop selftest [ticks] [port] hosts and joins a game over 127.0.0.1 in one process with two bots pressing random keys
+//and passes when both sides agree on every world hash, the exit code is 1 on a mismatch or when the game got stuck
+static bool CoopSelfTest(int ticks, unsigned short port)
+{
+	std::unique_ptr<SCoop> peers[2] = { std::unique_ptr<SCoop>(new SCoop()), std::unique_ptr<SCoop>(new SCoop()) };
+	std::unique_ptr<SWorld> views[2] = { std::unique_ptr<SWorld>(new SWorld()), std::unique_ptr<SWorld>(new SWorld()) };
+	for (int i = 0; i != 2; i++) peers[i]->view = views[i].get();
+	if (!peers[0]->Open(NULL, port, COOP_DELAY) || !peers[1]->Open("127.0.0.1", port, COOP_DELAY)) { printf("Co-op self-test could not open port %d\n", port); return false; }
+	ticks_t ticksum[2] = { 0, 0 };
+	for (int loop = 0; loop != ticks * 4 + 1000; loop++)
+	{
+		bool done = true;
+		for (int i = 0; i != 2; i++)
+		{
+			SCoop& c = *peers[i];
+			unsigned int r = (unsigned int)(c.inputs[c.me].size() / 20 + 1) * 2654435761u ^ (i ? 0x9E3779B9u : 0); //a new key combination every 20 ticks
+			r ^= r >> 15;
+			SInput in = { (signed char)(r % 3 - 1), (signed char)(r / 3 % 3 - 1), (r / 9 % 2 != 0), (r / 18 % 4 == 0) };
+			c.view->prof = SProfile();
+			if (!c.host && !c.started && loop % 100 == 0) c.Send(std::vector<unsigned char>(1, 'H')); //Frame resends it by the clock, which stands still during Load
+			c.Frame(in, 16, ticksum[i]);
+			done &= c.started && (c.confirmed >= (size_t)ticks || c.world.gameover);
+		}
+		if (done && peers[0]->confirmed == peers[1]->confirmed) break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	size_t confirmed = ZL_Math::Min(peers[0]->confirmed, peers[1]->confirmed), hashes = ZL_Math::Min(peers[0]->checks[0].size(), peers[1]->checks[1].size());
+	bool same = (hashes == confirmed / COOP_CHECK_TICKS && !peers[0]->desync && !peers[1]->desync);
+	for (size_t i = 0; i != hashes; i++) same &= (peers[0]->checks[0][i] == peers[1]->checks[1][i]);
+	bool ok = (same && (confirmed >= (size_t)ticks || (peers[0]->world.gameover && peers[1]->world.gameover)));
+	printf("Co-op self-test %s: %d ticks confirmed on both sides, %d of %d world hashes compared%s\n", (ok ? "passed" : "FAILED"),
+		(int)confirmed, (int)hashes, (int)(confirmed / COOP_CHECK_TICKS), (peers[0]->world.gameover ? ", game over" : ""));
+	return ok;
+}
+
+static void Frame()
+{
+	double t = ProfileTime();
+	if (!title && (coop.active || (!game.gameover && !game.win && !goback)))
+	{
+		#ifdef ZILLALOG //DEBUG KEYS
+		if (ZL_Input::Down(ZLK_F5)) game.SetRoom(game.level);
+		if (ZL_Input::Down(ZLK_F6)) game.SetRoom(game.level+1);
+		#endif
+
+		if (coop.active)
+		{
+			if (!game.win && ZL_Input::Down(ZLK_ESCAPE, true)) ZL_Application::Quit(); //the partner can't be paused
+		}
+		else if (ZL_Input::Down(ZLK_ESCAPE, true))
+			goback = true;
+
+		SInput in;
+		in.x = (signed char)(((ZL_Input::Held(ZLK_RIGHT) || ZL_Input::Held(ZLK_D)) ? 1 : 0) - ((ZL_Input::Held(ZLK_LEFT) || ZL_Input::Held(ZLK_A)) ? 1 : 0));
+		in.y = (signed char)(((ZL_Input::Held(ZLK_UP) || ZL_Input::Held(ZLK_W)) ? 1 : 0) - ((ZL_Input::Held(ZLK_DOWN) || ZL_Input::Held(ZLK_S)) ? 1 : 0));
+		in.grab = ZL_Input::Held(ZLK_SPACE);
+		in.strafe = ZL_Input::Held(ZLK_LSHIFT) || ZL_Input::Held(ZLK_RSHIFT);
+		game.prof.input = ProfileTime() - t;
+
+		static ticks_t TICKSUM = 0;
+		if (coop.active) coop.Frame(in, ZLELAPSEDTICKS, TICKSUM);
+		else if (ZL_Input::Held(ZLK_BACKSPACE))
+		{
+			//one snapshot per frame, so rewinding runs a few times faster than the game
+			if (RewindPop() && playbackpos) playbackpos = ZL_Math::Min(game.recording.size(), playback.size());
+			TICKSUM = 0;
+		}
+		else for (TICKSUM += ZLELAPSEDTICKS; TICKSUM > 16 && !game.gameover && !game.win; TICKSUM -= 16)
+		{
+			if (game.prof.substeps == MAX_SUBSTEPS) { TICKSUM = 16; break; }
+			game.StorePrevious();
+			game.Tick(playbackpos < playback.size() ? DecodeInput(playback[playbackpos++]) : in);
+			game.Match();
+			game.prof.substeps++;
+			if (!(game.recording.size() % REWIND_TICKS)) RewindPush();
+		}
+		renderalpha = (game.gameover || game.win || ZL_Input::Held(ZLK_BACKSPACE) ? 1 : ZL_Math::Clamp01(TICKSUM / 16.0f));
+		if (game.gameover && !coop.active) SaveReplay("DepotMania-last.replay");
+	}
+	ApplyEvents();
+
+	static float lastsz = 0;
+	float ar = ZL_Display::Width / ZL_Display::Height, sz = game.room.r + 1.0f;
+	if (!lastsz) lastsz = sz;
+	sz = lastsz = ZL_Math::Lerp(lastsz, sz, 1 - powf(.99f, ZLELAPSED * 60)); //same zoom speed as 1% per frame at 60 fps
+	ZL_Display::PushOrtho(-sz*ar, sz*ar, -sz, sz);
+
+	srfFloor.DrawTo(game.room.l, game.room.b, game.room.r, game.room.t);
+
+	if (title)
+	{
+		if (ZL_Input::Down(ZLK_ESCAPE))
+			ZL_Application::Quit();
+
+		if (loaded && (ZL_Input::Down(ZLK_RETURN) || ZL_Input::Down(ZLK_RETURN2) || ZL_Input::Down(ZLK_SPACE)))
+		{
+			game.Init((unsigned int)RAND_INT_MAX(0x7FFFFFFF));
+			playback.clear();
+			rewindbuf.frames.clear();
+			title = goback = false;
+		}
+
+		srfWall.DrawTo(game.room.l - 100.f, game.room.b - 100.f, game.room.r + 100.f, game.room.t + 100.f);
+		ZL_Display::PopOrtho();
+
+		static SCachedText txt(fntBig, "Depot", 1.5f, ZLWHITE, 5, 18);
+		txt.Draw(ZLV(ZLHALFW-200, ZLHALFH+200));
+
+		static SCachedText txt2(fntBig, "Mania", 1.5f, ZLWHITE, 5, 18);
+		ZL_Display::PushMatrix();
+		ZL_Display::Translate(ZLHALFW+200, ZLHALFH+200);
+		ZL_Display::Rotate(ssin(ZLSECONDS*20)*0.1f);
+		txt2.Draw(ZLV(0, 0));
+		ZL_Display::PopMatrix();
+
+		static SCachedText txt3(fntBig, "Connect 4 items of the same type to clear them", .4f, ZLWHITE, 3);
+		txt3.Draw(ZLV(ZLHALFW, ZLHALFH-20));
+		static SCachedText txt4(fntBig, "Connect 6 for bonus stars, clear all items once to win", .4f, ZLWHITE, 3);
+		txt4.Draw(ZLV(ZLHALFW, ZLHALFH-70));
+
+		static SCachedText txt5(fntBig, "Use Arrows or WASD to Move", .5f, ZLWHITE, 3);
+		txt5.Draw(ZLV(ZLHALFW, ZLHALFH-160));
+		static SCachedText txt6(fntBig, "Hold Space to Carry Items", .5f, ZLWHITE, 3);
+		txt6.Draw(ZLV(ZLHALFW, ZLHALFH-215));
+		static SCachedText txt7(fntBig, "Hold Shift to Strafe (Move without Turning)", .5f, ZLWHITE, 3);
+		txt7.Draw(ZLV(ZLHALFW, ZLHALFH-280));
+
+		static SCachedText txt8(fntMain, "(C) 2023 by Bernhard Schelling", .7f, ZLWHITE*.7f, 2);
+		txt8.Draw(ZLV(ZLHALFW, 20));
+		return;
+	}
+
+	t = ProfileTime();
+	DrawBoxes();
+	game.prof.boxes = ProfileTime() - t;
+
+	ZL_Vector playerp = cpvlerp(game.player.prevp, game.player.body->p, renderalpha);
+	scalar playera = game.player.preva + (game.player.body->a - game.player.preva) * renderalpha;
+	srfPlayer.Draw(ZLV(0.1,-0.1) + playerp, playera, ZLLUMA(0, 0.75));
+	srfPlayer.Draw(playerp, playera);
+	if (game.player2.body)
+	{
+		ZL_Vector player2p = cpvlerp(game.player2.prevp, game.player2.body->p, renderalpha);
+		scalar player2a = game.player2.preva + (game.player2.body->a - game.player2.preva) * renderalpha;
+		srfPlayer.Draw(ZLV(0.1,-0.1) + player2p, player2a, ZLLUMA(0, 0.75));
+		srfPlayer.Draw(player2p, player2a, ZLRGB(.6,.8,1));
+	}
+	DrawRoomLayer(sz, ar);
+	if (!game.spawnboxbody && game.tickNextBox)
+	{
+		float f = (float)(game.tickNextBox) / game.tickPerBox;
+		if (f <= 1.0f)
+		{
+			ZL_Color c = ItemColor(game.itemNextBox);
+			srfGFX.SetTilesetIndex(game.itemindices[game.itemNextBox]).Draw(0, game.room.b-0.1f-0.4f*f, 0.02f*(f+0.3f), 0.02f*(f+0.3f), ZLRGBA(c.r*0.8f, c.g*0.8f, c.b*0.8f, 0.8f));
+		}
+	}
+	ZL_Display::FillGradient(-0.5f, game.room.b-0.3f, 0.5f, game.room.b, ZLBLACK, ZLBLACK, ZLTRANSPARENT, ZLTRANSPARENT);
 
-static cpSpace *space;
-static cpBody *roombody, *spawnboxbody;
-static cpBB room;
-static int tickNextBox, tickPerBox;
-static ZL_Surface srfGFX, srfPlayer, srfFloor, srfWall, srfCheck, srfStar;
-static ZL_Font fntMain, fntBig;
-static ZL_TextBuffer txtItems, txtScore, txtExpansion;
-static int level, nitems, score, expansion, itemNextBox, boxes;
-static unsigned char itemindices[16];
-static unsigned char itemgoals[16];
-static ZL_Rect clearrec;
-static ZL_ParticleEffect particleSpark;
-static bool title, gameover, win, goback;
-static const ZL_Color shadow = ZLLUMA(0, .75f);
-extern ZL_SynthImcTrack imcMusic;
-extern TImcSongData imcDataIMCPICKUP, imcDataIMCDROP, imcDataIMCCHECK, imcDataIMCSTAR;
-static ZL_Sound sndPickup, sndDrop, sndCheck, sndStar;
-static std::vector<cpBody*> found;
+	t = ProfileTime();
+	sparks.Update(ZLELAPSED);
+	sparks.Draw();
+	game.prof.particles = ProfileTime() - t;
 
-static struct SPlayer
-{
-	cpBody* body;
-	cpShape *mainshape, *grabshape;
-	cpFloat angle = 0;
-} player;
+	#ifdef ZILLALOG //DEBUG DRAW
+	if (ZL_Input::Held(ZLK_RSHIFT)) { void DebugDrawConstraint(cpConstraint*, void*); cpSpaceEachConstraint(game.space, DebugDrawConstraint, NULL); }
+	if (ZL_Input::Held(ZLK_RSHIFT)) { void DebugDrawShape(cpShape*,void*); cpSpaceEachShape(game.space, DebugDrawShape, NULL); }
+	#endif
 
-static void FixVelocityFunc(cpBody *body, cpVect gravity, cpFloat damping, cpFloat dt) {}
-static void FixUpdatePositionFunc(cpBody *body, cpFloat dt) {}
+	ZL_Display::PopOrtho();
+	t = ProfileTime();
+	txtItems.DrawBottomLeft(10, ZLFROMH(40));
+	txtScore.DrawBottomLeft(10, ZLFROMH(80));
+	txtExpansion.DrawBottomLeft(10, ZLFROMH(120));
+	float itemstep = ZL_Math::Min(40.f, (ZLWIDTH - 178.f) / game.nitems); //squeezed together when there are too many for the screen width
+	for (int i = 0; i != game.nitems; i++)
+	{
+		srfGFX.Draw(158.0f + i * itemstep+3, ZLFROMH(32)-3, shadow);
+		srfGFX.SetTilesetIndex(game.itemindices[i]).Draw(158.0f + i * itemstep, ZLFROMH(32), ItemColor(i));
+		if (game.itemgoals[i] & 1) srfCheck.Draw(158.0f + i * itemstep, ZLFROMH(32));
+		if (game.itemgoals[i] & 2) srfStar.Draw(158.0f + i * itemstep, ZLFROMH(32));
+	}
 
-static void RemoveBody(cpBody* body)
-{
-	while (body->constraintList) { cpConstraint* c = body->constraintList; cpSpaceRemoveConstraint(space, c); cpConstraintFree(c); }
-	while (body->shapeList) { cpShape* shp = body->shapeList; cpSpaceRemoveShape(space, shp); cpShapeFree(shp); }
-	cpSpaceRemoveBody(space, body);
-	cpBodyFree(body);
+	if (game.gameover)
+	{
+		if (ZL_Input::Down(ZLK_ESCAPE)) title = true;
+		static SCachedText txt(fntBig, "Game Over", 1.5f, ZLWHITE, 5);
+		txt.Draw(ZLCENTER);
+		static SCachedText txt2(fntBig, "Press ESC to Return to Title", .5f, ZLWHITE, 3);
+		txt2.Draw(ZLV(ZLHALFW, ZLHALFH-160));
+	}
+	if (game.win)
+	{
+		if (ZL_Input::Down(ZLK_ESCAPE)) game.win = coop.won = false;
+		static SCachedText txt(fntBig, "You Win! Congratulation!", 1.5f, ZLWHITE, 5);
+		txt.Draw(ZLCENTER);
+		static SCachedText txt2(fntBig, "Thank you for playing", .5f, ZLWHITE, 3);
+		txt2.Draw(ZLV(ZLHALFW, ZLHALFH-110));
+		static SCachedText txt3(fntBig, "Press ESC to Continue Playing", .5f, ZLWHITE, 3);
+		txt3.Draw(ZLV(ZLHALFW, ZLHALFH-190));
+	}
+	if (goback)
+	{
+		if (ZL_Input::Down(ZLK_ESCAPE)) { title = true; SaveReplay("DepotMania-last.replay"); }
+		if (ZL_Input::Down(ZLK_SPACE)) goback = false;
+		static SCachedText txt(fntBig, "Paused", 1.5f, ZLWHITE, 5);
+		txt.Draw(ZLCENTER);
+		static SCachedText txt2(fntBig, "Press ESC to Return to Title", .5f, ZLWHITE, 3);
+		txt2.Draw(ZLV(ZLHALFW, ZLHALFH-110));
+		static SCachedText txt3(fntBig, "Press Space to Continue Playing", .5f, ZLWHITE, 3);
+		txt3.Draw(ZLV(ZLHALFW, ZLHALFH-190));
+	}
+	if (coop.active && (!coop.started || coop.lost))
+	{
+		static SCachedText txt(fntBig, "Waiting for the other player", .8f, ZLWHITE, 4), txt2(fntBig, "Connection lost", .8f, ZLWHITE, 4);
+		(coop.lost ? txt2 : txt).Draw(ZLV(ZLHALFW, ZLHALFH+160));
+	}
+	game.prof.hud = ProfileTime() - t;
 }
 
-static void BoxBodyUpdatePosition(cpBody *body, cpFloat dt)
+static const SProfileSample& ProfilerSample(size_t i) //0 is the oldest recorded frame
 {
-	cpBodyUpdatePosition(body, dt);
-	if (body->constraintList || body->arbiterList || body == spawnboxbody) return;
+	return profiler.samples[(profiler.samples.size() < PROFILER_SAMPLES ? i : (profiler.next + i) % PROFILER_SAMPLES)];
+}
 
-	float diffa = smod(PI2*10 + body->a + PIHALF/2, PIHALF) - PIHALF/2;
-	body->a -= diffa*.1f;
+static void ProfilerWriteCSV(const char* path)
+{
+	FILE* f = fopen(path, "w");
+	if (!f) return;
+	fputs("frame,interval_ms,frame_us,input_us,substeps,step_us,match_us,boxes_us,hud_us,particles_us,bodies,shapes,constraints,particles\n", f);
+	for (size_t i = 0; i != profiler.samples.size(); i++)
+	{
+		const SProfileSample& smp = ProfilerSample(i);
+		fprintf(f, "%d,%d,%.1f,%.1f,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%d,%d,%d,%d\n", smp.frame, smp.interval, smp.prof.frame, smp.prof.input, smp.prof.substeps,
+			smp.prof.step, smp.prof.match, smp.prof.boxes, smp.prof.hud, smp.prof.particles, smp.bodies, smp.shapes, smp.constraints, smp.particles);
+	}
+	fclose(f);
+}
 
-	cpVect diffp = cpv(smod(body->p.x + 1000.f +.5f, 1.0f) - .5f, smod(body->p.y + 1000.f + .5f, 1.0f) - .5f);
-	body->p = cpvsub(body->p, cpvmult(diffp, .05f));
+//Prints the box count at which each section of a stress run first takes longer than a whole 60 fps frame
+static void StressReport()
+{
+	static const struct { const char* name; double SProfile::*field; } sections[] = { { "frame", &SProfile::frame }, { "physics", &SProfile::step }, { "matching", &SProfile::match }, { "box drawing", &SProfile::boxes } };
+	for (int i = 0; i != COUNT_OF(sections); i++)
+	{
+		if (stress.over[i] || game.prof.*sections[i].field < 16000) continue;
+		stress.over[i] = true;
+		printf("Stress: %s took %.1f ms (%d physics steps) with %d boxes in a %dx%d room after %u ticks\n", sections[i].name, game.prof.*sections[i].field / 1000, game.prof.substeps,
+			game.boxes, game.grid.w, game.grid.h, (unsigned int)game.recording.size());
+	}
+	if (game.gameover && !stress.done)
+	{
+		stress.done = true;
+		printf("Stress: room full with %d boxes after %u ticks, score %d\n", game.boxes, (unsigned int)game.recording.size(), game.score);
+	}
 }
 
-static void Load()
+//Bytes held by the game itself next to what chipmunk allocated, the bodies, shapes and joints in the pools are already counted with chipmunk's
+enum { MEMGAME_POOLS, MEMGAME_FOUND, MEMGAME_PARTICLES, MEMGAME_GRID, MEMGAME_REWIND, MEMGAME_COUNT };
+static const char* const memgamenames[MEMGAME_COUNT] = { "box pool", "found", "particles", "grid", "rewind" };
+static void MemGame(size_t (&bytes)[MEMGAME_COUNT])
 {
-	srfGFX = ZL_Surface("Data/gfx.png").SetTilesetClipping(4, 4).SetOrigin(ZL_Origin::Center);
-	srfPlayer = ZL_Surface("Data/player.png").SetOrigin(ZL_Origin::Center).SetScale(0.02f);
-	srfFloor = ZL_Surface("Data/floor.png").SetTextureRepeatMode();
-	srfFloor.SetScale(1.0f/srfFloor.GetWidth(), 1.0f/srfFloor.GetHeight());
-	srfWall = ZL_Surface("Data/wall.png").SetTextureRepeatMode();
-	srfWall.SetScale(1.0f/srfWall.GetWidth(), 1.0f/srfFloor.GetHeight());
-	srfCheck = ZL_Surface("Data/check.png").SetOrigin(ZL_Origin::Center);
-	srfStar = ZL_Surface("Data/star.png").SetOrigin(ZL_Origin::Center);
-
-	particleSpark = ZL_ParticleEffect(500, 200);
-	particleSpark.AddParticleImage(ZL_Surface("Data/spark.png"), 200); //.SetColor(ZLRGB(1,.8,.1)), 200);
-	particleSpark.AddBehavior(new ZL_ParticleBehavior_LinearMove(1, 0.3f));
-	particleSpark.AddBehavior(new ZL_ParticleBehavior_LinearImageProperties(1, 0, 0.03f, 0.01f));
-
-	fntMain = ZL_Font("Data/typomoderno.ttf.zip", 30.0f);
-	fntBig = ZL_Font("Data/typomoderno.ttf.zip", 100.0f);
-	txtItems = ZL_TextBuffer(fntMain, ZL_String::format("Items: %d/%d", nitems, COUNT_OF(itemindices)).c_str());
-	txtScore = ZL_TextBuffer(fntMain, ZL_String::format("Score: %d", score).c_str());
-	txtExpansion = ZL_TextBuffer(fntMain, ZL_String::format("Upgrade In: %d", expansion).c_str());
-
-	sndPickup = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCPICKUP);
-	sndDrop = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCDROP);
-	sndCheck = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCCHECK);
-	sndStar = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCSTAR);
-	imcMusic.Play();
+	bytes[MEMGAME_POOLS] = game.boxstore.size() * (sizeof(SWorld::SBox) - sizeof(cpBody) - sizeof(cpPolyShape));
+	bytes[MEMGAME_FOUND] = game.found.capacity() * sizeof(cpBody*);
+	bytes[MEMGAME_PARTICLES] = sizeof(sparks.x) * 6 + game.events.sparks.capacity() * sizeof(cpVect);
+	bytes[MEMGAME_GRID] = 0;
+	for (std::vector<uint64_t>* v : { &game.grid.aligned, &game.grid.loose, &game.grid.lastaligned, &game.grid.lastloose, &game.grid.dirty, &game.grid.work, &game.grid.comp })
+		bytes[MEMGAME_GRID] += v->capacity() * sizeof(uint64_t);
+	bytes[MEMGAME_REWIND] = rewindbuf.cur.capacity();
+	for (const std::vector<unsigned char>& frame : rewindbuf.frames) bytes[MEMGAME_REWIND] += frame.capacity();
+}
 
-	title = true;
+static void MemoryReport(FILE* f)
+{
+	fprintf(f, "Memory: %.1f MB resident, %.1f MB peak\n", ResidentMemory(), ResidentMemory(true));
+	fprintf(f, "  chipmunk %12s %8s %12s\n", "bytes", "blocks", "peak bytes");
+	for (int i = 0; i != MEM_COUNT; i++)
+		fprintf(f, "  %-12s %10d %8d %12d\n", memnames[i], (int)memcounters[i].bytes, (int)memcounters[i].count, (int)memcounters[i].peak);
+	fprintf(f, "  %-12s %10d %8d %12d\n", "total", (int)memtotal.bytes, (int)memtotal.count, (int)memtotal.peak);
+	size_t gamebytes[MEMGAME_COUNT];
+	MemGame(gamebytes);
+	fprintf(f, "  game %16s\n", "bytes");
+	for (int i = 0; i != MEMGAME_COUNT; i++) fprintf(f, "  %-16s %10d\n", memgamenames[i], (int)gamebytes[i]);
 }
 
-static void SetRoom(int _level = 0)
+static void Profiler()
 {
-	int h = 3 + _level / 4, w = h + ((_level % 4) / 2);
-	expansion += (w*h)-5;
-	if (expansion <= 0) { SetRoom(_level + 1); return; }
+	profiler.frame++;
+	if (ZL_Input::Down(ZLK_F3)) { profiler.active = !profiler.active; profiler.samples.clear(); profiler.next = 0; }
+	if (!profiler.active || !game.space) return;
+
+	SProfileSample smp = { game.prof, profiler.frame, (int)ZLELAPSEDTICKS, 0, 0, 0, sparks.count };
+	cpSpaceEachBody(game.space, [](cpBody*, void* n) { (*(int*)n)++; }, &smp.bodies);
+	cpSpaceEachShape(game.space, [](cpShape*, void* n) { (*(int*)n)++; }, &smp.shapes);
+	cpSpaceEachConstraint(game.space, [](cpConstraint*, void* n) { (*(int*)n)++; }, &smp.constraints);
+	if (profiler.samples.size() < PROFILER_SAMPLES) profiler.samples.push_back(smp);
+	else profiler.samples[profiler.next] = smp;
+	profiler.next = (profiler.next + 1) % PROFILER_SAMPLES;
+	if (ZL_Input::Down(ZLK_F4)) ProfilerWriteCSV("DepotMania-profile.csv");
+
+	//Graph bars are 2 pixels per frame and 4 pixels per millisecond, gray is the time between frames, colors the sections of the frame
+	size_t n = ZL_Math::Min(profiler.samples.size(), (size_t)PROFILER_GRAPH), first = profiler.samples.size() - n;
+	scalar x0 = ZLFROMW(PROFILER_GRAPH*2 + 10), y0 = 10;
+	ZL_Display::FillRect(x0 - 5, y0 - 5, ZLFROMW(5), y0 + 230, ZLLUMA(0, .7f));
+	for (size_t i = 0; i != n; i++)
+	{
+		const SProfileSample& smp = ProfilerSample(first + i);
+		scalar x = x0 + i * 2, y = y0;
+		ZL_Display::FillRect(x, y, x + 2, y + smp.interval * 4.f, ZLLUMA(.4f, 1));
+		const double secs[] = { smp.prof.input, smp.prof.step, smp.prof.match, smp.prof.boxes, smp.prof.particles, smp.prof.hud };
+		const ZL_Color cols[] = { ZL_Color::White, ZL_Color::Red, ZL_Color::Yellow, ZL_Color::Green, ZL_Color::Magenta, ZLRGB(0,1,1) };
+		for (int j = 0; j != COUNT_OF(secs); j++) { scalar h = (scalar)(secs[j] / 250.0); ZL_Display::FillRect(x, y, x + 2, y + h, cols[j]); y += h; }
+	}
+	ZL_Display::DrawLine(x0, y0 + 16.67f * 4.f, ZLFROMW(10), y0 + 16.67f * 4.f, ZLRGBA(1,1,1,.5f));
 
-	room = cpBBNew(-w+.5f, -h+.5f, w-.5f, h-.5f);
-	if (roombody) RemoveBody(roombody);
-	roombody = cpSpaceAddBody(space, cpBodyNew(999999999.f, INFINITY));
-	cpBodySetVelocityUpdateFunc(roombody, FixVelocityFunc);
-	cpBodySetPositionUpdateFunc(roombody, FixUpdatePositionFunc);
-	cpSpaceAddShape(space, cpBoxShapeNew2(roombody, cpBBNew(room.l-1.f, room.t, room.r+1.f, room.t+1.f), 0));
-	cpSpaceAddShape(space, cpBoxShapeNew2(roombody, cpBBNew(room.l-1.f, room.b-1.f, room.r+1.f, room.b), 0));
-	cpSpaceAddShape(space, cpBoxShapeNew2(roombody, cpBBNew(room.l-1.f, room.b-1.f, room.l, room.t+1.f), 0));
-	cpSpaceAddShape(space, cpBoxShapeNew2(roombody, cpBBNew(room.r, room.b-1.f, room.r+1.f, room.t+1.f), 0));
+	SProfile avg = SProfile();
+	size_t m = ZL_Math::Min(profiler.samples.size(), (size_t)60);
+	for (size_t i = profiler.samples.size() - m; i != profiler.samples.size(); i++)
+	{
+		const SProfile& p = ProfilerSample(i).prof;
+		avg.frame += p.frame / m; avg.input += p.input / m; avg.step += p.step / m; avg.match += p.match / m;
+		avg.boxes += p.boxes / m; avg.hud += p.hud / m; avg.particles += p.particles / m; avg.substeps += p.substeps;
+	}
+	const SProfileSample& last = ProfilerSample(profiler.samples.size() - 1);
+	size_t gamebytes[MEMGAME_COUNT];
+	MemGame(gamebytes);
+	ZL_String txt[] = {
+		ZL_String::format("frame %.0f us, %.2f substeps", avg.frame, avg.substeps / (float)m),
+		ZL_String::format("input %.0f  step %.0f  match %.0f us", avg.input, avg.step, avg.match),
+		ZL_String::format("boxes %.0f  particles %.0f  hud %.0f us", avg.boxes, avg.particles, avg.hud),
+		ZL_String::format("%d bodies, %d shapes, %d constraints, %d particles", last.bodies, last.shapes, last.constraints, last.particles),
+		ZL_String::format("memory %.1f MB (peak %.1f), chipmunk %d KB (peak %d)", ResidentMemory(), ResidentMemory(true), (int)(memtotal.bytes >> 10), (int)(memtotal.peak >> 10)),
+		ZL_String::format("KB: bodies %d shapes %d joints %d arbiters %d index %d space %d", (int)(memcounters[MEM_BODIES].bytes >> 10),
+			(int)(memcounters[MEM_SHAPES].bytes >> 10), (int)(memcounters[MEM_CONSTRAINTS].bytes >> 10), (int)(memcounters[MEM_ARBITERS].bytes >> 10), (int)(memcounters[MEM_INDEX].bytes >> 10), (int)(memcounters[MEM_SPACE].bytes >> 10)),
+		ZL_String::format("KB: pools %d found %d particles %d grid %d rewind %d", (int)(gamebytes[MEMGAME_POOLS] >> 10), (int)(gamebytes[MEMGAME_FOUND] >> 10),
+			(int)(gamebytes[MEMGAME_PARTICLES] >> 10), (int)(gamebytes[MEMGAME_GRID] >> 10), (int)(gamebytes[MEMGAME_REWIND] >> 10)),
+	};
+	for (int i = 0; i != COUNT_OF(txt); i++)
+		fntMain.Draw(x0, y0 + 200 - i * 18, txt[i].c_str(), .5f, ZLWHITE);
+}
 
-	srfFloor.SetColor(ZL_Color::HSVA(RAND_FACTOR,0.5f,0.3f));
-	srfWall.SetColor(ZL_Color::HSVA(RAND_FACTOR,0.25f,0.3f));
+static void PrintSpeed(unsigned int ticks, ticks_t start)
+{
+	ticks_t ms = ZL_Application::GetTicks() - start;
+	printf("%u ticks in %u ms, %.0f ticks per second (%.1fx real time)\n", ticks, (unsigned int)ms, ticks * 1000.0 / (ms ? ms : 1), ticks * 16.0 / (ms ? ms : 1));
+}
 
-	level = _level;
-	nitems = ZL_Math::Min(2 + _level, (int)COUNT_OF(itemindices));
-	tickPerBox = (level == 0 ? 3500 : (level == 1 ? 3000 : (level == 2 ? 2600 : 2200)));
+//Random player for the headless and batch runs that holds each random input for a random number of ticks
+//It is seeded from the game seed so every game can be reproduced on its own
+struct SBot
+{
+	unsigned int state;
+	int hold;
+	SInput in;
 
-	txtExpansion.SetText(ZL_String::format("Upgrade In: %d", expansion).c_str());
-	txtItems.SetText(ZL_String::format("Items: %d/%d", nitems, COUNT_OF(itemindices)).c_str());
-}
+	void Reset(unsigned int _seed) { state = ~_seed; hold = 0; in = SInput(); }
+	int Rand(int min, int max) { state = state * 1664525u + 1013904223u; return min + (int)((state >> 8) % (unsigned int)(max - min + 1)); }
+	const SInput& Next()
+	{
+		if (--hold > 0) return in;
+		in.x = (signed char)Rand(-1, 1);
+		in.y = (signed char)Rand(-1, 1);
+		in.grab = !!Rand(0, 1);
+		in.strafe = !Rand(0, 3);
+		hold = Rand(5, 60);
+		return in;
+	}
+};
 
-static void Init()
+//Plays whole games with random input without display or audio as fast as possible, for soak testing on machines without a GPU
+static void Headless(int games, int maxticks, unsigned int firstseed)
 {
-	if (space)
+	int wins = 0, levels = 0, scores = 0;
+	unsigned int totalticks = 0;
+	ticks_t start = ZL_Application::GetTicks();
+	SBot bot;
+	for (int i = 0; i != games; i++)
 	{
-		cpSpaceEachBody(space, [](cpBody *body, void*) { cpSpaceAddPostStepCallback(space, [](cpSpace *space, void *body, void*) { RemoveBody((cpBody*)body); }, body, NULL); }, NULL);
-		cpSpaceFree(space);
+		game.Init(firstseed + i);
+		bot.Reset(game.seed);
+		int t = 0;
+		for (; t != maxticks && !game.gameover; t++)
+		{
+			game.Tick(bot.Next());
+			game.Match();
+			game.ResetEvents();
+			if (game.win) { wins++; game.win = false; }
+		}
+		totalticks += t;
+		levels += game.level;
+		scores += game.score;
+		printf("Game %d (seed %u): level %d, score %d, %s after %d ticks\n", i + 1, game.seed, game.level, game.score, (game.gameover ? "game over" : "stopped"), t);
 	}
-	roombody = spawnboxbody = NULL;
-	space = cpSpaceNew();
+	printf("%d games, %d wins, average level %.1f, average score %.1f\n", games, wins, (games ? levels / (float)games : 0.f), (games ? scores / (float)games : 0.f));
+	PrintSpeed(totalticks, start);
+}
 
-	cpSpaceSetDamping(space, 0.0001f);
-	cpSpaceSetCollisionSlop(space, .0001f); //Defaults to 0.1.
+//Runs the loaded replay to its end without any rendering as fast as possible
+static void FastReplay()
+{
+	ticks_t start = ZL_Application::GetTicks();
+	while (playbackpos < playback.size() && !game.gameover)
+	{
+		game.Tick(DecodeInput(playback[playbackpos++]));
+		game.Match();
+		game.ResetEvents();
+		game.win = false;
+	}
+	printf("Replay of seed %u: level %d, score %d, %s after %u of %u ticks\n", game.seed, game.level, game.score, (game.gameover ? "game over" : "stopped"), (unsigned int)playbackpos, (unsigned int)playback.size());
+	PrintSpeed((unsigned int)playbackpos, start);
+}
 
-	player.body = cpSpaceAddBody(space, cpBodyNew(1, cpMomentForCircle(1, 0, 0.5f, cpvzero)));
-	player.body->a = player.angle = -PIHALF;
-	player.mainshape = cpSpaceAddShape(space, cpCircleShapeNew(player.body, 0.5f, cpvzero));
-	player.grabshape = cpSpaceAddShape(space, cpCircleShapeNew(player.body, 0.4f, cpv(0.4f, 0)));
-	cpShapeSetFilter(player.grabshape, CP_SHAPE_FILTER_NONE);
+//Steps many independent worlds at once for automated balancing and bot training
+//Each call hands all worlds to the worker threads and returns once every one of them is done, with no threads the calling thread steps them
+//A world that ended in game over is restarted at the start of its next step with its seed advanced by the number of worlds and reports done once
+struct SObservation
+{
+	float x, y, angle;
+	int level, score, reward, boxes;
+	bool carrying, won, done;
+	std::vector<signed char> cells; //item index per room cell from the bottom left, -1 if empty
+};
 
-	score = expansion = 0;
-	tickNextBox = 3000;
-	itemNextBox = RAND_INT_RANGE(0, nitems-1);
-	gameover = win = goback = false;
+static struct SBatch
+{
+	std::vector<SWorld> worlds;
+	std::vector<SObservation> obs;
+	std::vector<SInput> inputs;
+	std::vector<unsigned int> seeds;
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, finished;
+	std::atomic<int> next;
+	int pending;
+	unsigned int generation;
+	bool reset, quit;
+} batch;
+
+static void BatchObserve(SWorld& w, SObservation& o)
+{
+	o.x = (float)w.player.body->p.x;
+	o.y = (float)w.player.body->p.y;
+	o.angle = (float)w.player.body->a;
+	o.level = w.level;
+	o.boxes = w.boxes;
+	o.carrying = !!w.player.body->constraintList;
+	o.done = w.gameover;
+	o.cells.assign((size_t)w.grid.w * w.grid.h, -1);
+	for (const SWorld::SBox* box : w.live) //not the loose grid, it still has the boxes Match just cleared
+		for (int y = box->y0; y <= box->y1; y++) //the cells covered at the last step, none while carried
+			for (int x = box->x0; x <= box->x1; x++)
+				o.cells[y * w.grid.w + x] = (signed char)box->item;
+}
 
-	memset(itemgoals, 0, sizeof(itemgoals));
-	for (int i = 0; i != (int)COUNT_OF(itemindices); i++)
+static void BatchRun(int i)
+{
+	SWorld& w = batch.worlds[i];
+	SObservation& o = batch.obs[i];
+	o.reward = 0;
+	if (batch.reset) w.Init(batch.seeds[i]);
+	else
 	{
-		idxretry:
-		itemindices[i] = RAND_INT_MAX(COUNT_OF(itemindices)-1);
-		for (int j = 0; j != i; j++) if (itemindices[i] == itemindices[j]) goto idxretry;
+		if (w.gameover) w.Init(w.seed + (unsigned int)batch.worlds.size());
+		int before = w.score;
+		w.Tick(batch.inputs[i]);
+		w.Match();
+		o.reward = w.score - before;
 	}
-
-	SetRoom();
+	w.ResetEvents();
+	o.score = w.score;
+	o.won = w.win;
+	w.win = false;
+	BatchObserve(w, o);
 }
 
-static void DrawBox(cpShape* shape, void*)
+static void BatchWorker()
 {
-	if (!shape->body->userData) return;
-	cpPolyShape *poly = (cpPolyShape *)shape;
-	ZL_Vector off = ZLV(0.05f, -0.05f);
-	ZL_Display::FillQuad(off+poly->planes[0].v0, off+poly->planes[1].v0, off+poly->planes[2].v0, off+poly->planes[3].v0, (shape->body->constraintList ? ZLRGBA(1,1,0,0.5f) : ZLLUMA(0, 0.5f)));
-	srfGFX.SetTilesetIndex(itemindices[(int)shape->body->userData - 1]);
-	srfGFX.DrawQuad(poly->planes[0].v0, poly->planes[1].v0, poly->planes[2].v0, poly->planes[3].v0);
-	ZL_Display::DrawQuad(poly->planes[0].v0, poly->planes[1].v0, poly->planes[2].v0, poly->planes[3].v0, (shape->body->constraintList ? ZL_Color::Yellow : ZLBLACK));
-	boxes++;
+	for (unsigned int seen = 0;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(batch.mutex);
+			batch.wake.wait(lock, [&seen] { return batch.quit || batch.generation != seen; });
+			if (batch.quit) return;
+			seen = batch.generation;
+		}
+		int ran = 0;
+		for (int i; (i = batch.next++) < (int)batch.worlds.size(); ran++) BatchRun(i);
+		std::lock_guard<std::mutex> lock(batch.mutex);
+		if ((batch.pending -= ran) == 0) batch.finished.notify_all();
+	}
 }
 
-static cpBody* GetBoxAt(float x, float y, bool imperfect)
+static void BatchDispatch()
 {
-	cpBody* res = NULL;
-	cpSpaceBBQuery(space, cpBBNewForCircle(cpv(x, y), 0.01f), CP_SHAPE_FILTER_ALL, [](cpShape *shape, void *data)
-		{ if (shape->body->userData)  *((cpBody**)data) = shape->body; }, &res);
-	if (!res || res->constraintList) return NULL;
-	if (imperfect) return res;
-	if (sabs(res->p.x - x) > 0.05f || sabs(res->p.y - y) > 0.05f) return NULL;
-	float diffa = smod(PI2*10 + res->a + PIHALF/2, PIHALF) - PIHALF/2;
-	if (sabs(diffa) > 0.01f) return NULL;
-	return res;
+	if (batch.threads.empty()) { for (int i = 0; i != (int)batch.worlds.size(); i++) BatchRun(i); return; }
+	std::unique_lock<std::mutex> lock(batch.mutex);
+	batch.next = 0;
+	batch.pending = (int)batch.worlds.size();
+	batch.generation++;
+	batch.wake.notify_all();
+	batch.finished.wait(lock, [] { return batch.pending == 0; });
 }
 
-//static int ClearBoxAndNeighbors(cpBody* box, float x, float y)
-//{
-//	cpDataPointer p = box->userData;
-//	particleSpark.Spawn(25, box->p, 0, .5f, .5f);
-//	RemoveBody(box);
-//	int res = 1;
-//	cpBody* nbox;
-//	if ((nbox = GetBoxAt(x+1, y, true)) != NULL && nbox->userData == p) res += ClearBoxAndNeighbors(nbox, x+1, y);
-//	if ((nbox = GetBoxAt(x, y+1, true)) != NULL && nbox->userData == p) res += ClearBoxAndNeighbors(nbox, x, y+1);
-//	if ((nbox = GetBoxAt(x-1, y, true)) != NULL && nbox->userData == p) res += ClearBoxAndNeighbors(nbox, x-1, y);
-//	if ((nbox = GetBoxAt(x, y-1, true)) != NULL && nbox->userData == p) res += ClearBoxAndNeighbors(nbox, x, y-1);
-//	return res;
-//}
+static const std::vector<SObservation>& BatchReset(const std::vector<unsigned int>& seeds)
+{
+	batch.seeds = seeds;
+	batch.reset = true;
+	BatchDispatch();
+	batch.reset = false;
+	return batch.obs;
+}
 
-static void FillNeighbors(cpBody* box, float x, float y)
+static const std::vector<SObservation>& BatchStep(const std::vector<SInput>& inputs)
 {
-	found.push_back(box);
-	cpBody* nbox;
-	cpDataPointer p = box->userData;
-	if ((nbox = GetBoxAt(x+1, y, found.size() >= 4)) != NULL && nbox->userData == p && std::find(found.begin(), found.end(), nbox) == found.end()) FillNeighbors(nbox, x+1, y);
-	if ((nbox = GetBoxAt(x, y+1, found.size() >= 4)) != NULL && nbox->userData == p && std::find(found.begin(), found.end(), nbox) == found.end()) FillNeighbors(nbox, x, y+1);
-	if ((nbox = GetBoxAt(x-1, y, found.size() >= 4)) != NULL && nbox->userData == p && std::find(found.begin(), found.end(), nbox) == found.end()) FillNeighbors(nbox, x-1, y);
-	if ((nbox = GetBoxAt(x, y-1, found.size() >= 4)) != NULL && nbox->userData == p && std::find(found.begin(), found.end(), nbox) == found.end()) FillNeighbors(nbox, x, y-1);
+	batch.inputs = inputs;
+	BatchDispatch();
+	return batch.obs;
 }
 
-static void DrawTextBordered(const ZL_TextBuffer& buf, const ZL_Vector& p, scalar scale = 1, const ZL_Color& colfill = ZLWHITE, const ZL_Color& colborder = ZLBLACK, int border = 2, ZL_Origin::Type origin = ZL_Origin::Center)
+static void BatchInit(int worlds, int threads)
 {
-	for (int i = 0; i < 9; i++) if (i != 4) buf.Draw(p.x+(border*((i%3)-1)), p.y+(border*((i/3)-1)), scale, scale, colborder, origin);
-	buf.Draw(p.x, p.y, scale, scale, colfill, origin);
+	batch.worlds = std::vector<SWorld>(worlds); //fixed from here on, each space points back to its world
+	batch.obs.resize(worlds);
+	batch.quit = false;
+	for (int i = 0; i != threads; i++) batch.threads.push_back(std::thread(BatchWorker));
 }
 
-static void Frame()
+static void BatchShutdown()
 {
-	if (!title && !gameover && !win && !goback)
 	{
-		#ifdef ZILLALOG //DEBUG KEYS
-		if (ZL_Input::Down(ZLK_F5)) SetRoom(level);
-		if (ZL_Input::Down(ZLK_F6)) SetRoom(level+1);
-		#endif
-
-		if (ZL_Input::Down(ZLK_ESCAPE, true))
-			goback = true;
-
-		ZL_Vector inp = ZLV(
-			((ZL_Input::Held(ZLK_RIGHT) || ZL_Input::Held(ZLK_D)) ? 1 : 0) - ((ZL_Input::Held(ZLK_LEFT) || ZL_Input::Held(ZLK_A)) ? 1 : 0),
-			((ZL_Input::Held(ZLK_UP) || ZL_Input::Held(ZLK_W)) ? 1 : 0) - ((ZL_Input::Held(ZLK_DOWN) || ZL_Input::Held(ZLK_S)) ? 1 : 0)
-		);
+		std::lock_guard<std::mutex> lock(batch.mutex);
+		batch.quit = true;
+		batch.wake.notify_all();
+	}
+	for (std::thread& t : batch.threads) t.join();
+	batch.threads.clear();
+	for (SWorld& w : batch.worlds) w.Free();
+	batch.worlds.clear();
+}
 
-		bool grab = ZL_Input::Held(ZLK_SPACE), strafe = ZL_Input::Held(ZLK_LSHIFT) || ZL_Input::Held(ZLK_RSHIFT);
-	
-		static ticks_t TICKSUM = 0;
-		for (TICKSUM += ZLELAPSEDTICKS; TICKSUM > 16; TICKSUM -= 16)
+//Runs the random player in many worlds at once through the batch interface to measure how it scales with threads
+static void BatchRandom(int worlds, int threads, int ticks, unsigned int firstseed)
+{
+	BatchInit(worlds, threads);
+	std::vector<unsigned int> seeds(worlds);
+	std::vector<SBot> bots(worlds);
+	std::vector<SInput> inputs(worlds);
+	for (int i = 0; i != worlds; i++) { seeds[i] = firstseed + i; bots[i].Reset(seeds[i]); }
+	int games = 0, wins = 0, scores = 0;
+	ticks_t start = ZL_Application::GetTicks();
+	BatchReset(seeds);
+	for (int t = 0; t != ticks; t++)
+	{
+		for (int i = 0; i != worlds; i++) inputs[i] = bots[i].Next();
+		const std::vector<SObservation>& obs = BatchStep(inputs);
+		for (int i = 0; i != worlds; i++)
 		{
-			cpVect v = cpBodyGetVelocity(player.body);
-			cpBodySetForce(player.body, cpv(inp.x*50, inp.y*50));
+			scores += obs[i].reward;
+			if (obs[i].won) wins++;
+			if (obs[i].done) { games++; bots[i].Reset(batch.worlds[i].seed + worlds); }
+		}
+	}
+	printf("%d worlds on %d threads: %d games over, %d wins, %d points scored\n", worlds, threads, games, wins, scores);
+	PrintSpeed((unsigned int)worlds * ticks, start);
+	BatchShutdown();
+}
 
-			if (!!inp && !strafe) player.angle = inp.GetAngle();
-			float rel = ZL_Math::RelAngle(cpBodyGetAngle(player.body), player.angle);
-			cpBodySetAngularVelocity(player.body, rel*10);
+//Canned scenarios timed by -bench, each one runs for BENCH_FRAMES rendered frames
+//The two sparks scenarios clear 40 boxes every 15 frames, once with the spark store and once with the ZL_ParticleEffect it replaced
+enum { BENCH_EMPTY, BENCH_HALF, BENCH_FULL, BENCH_CLEAR, BENCH_GRAB, BENCH_SPARKS, BENCH_SPARKS_ZL, BENCH_COUNT, BENCH_FRAMES = 240 };
+static const char* BenchNames[BENCH_COUNT] = { "empty", "half", "full", "clear", "grab", "sparks", "sparks_zl" };
+static struct SBench
+{
+	bool active;
+	int scenario, frame;
+	SProfile sum, max;
+	FILE* out;
+	ZL_ParticleEffect zlsparks;
+} bench;
+
+//Every result is one line of JSON on stdout and in the file given to -bench
+static void BenchLine(const ZL_String& line)
+{
+	for (FILE* f : { stdout, bench.out })
+		if (f) fprintf(f, "%s\n", line.c_str());
+}
 
-			if (grab && !player.body->constraintList)
-			{
-				cpShapeSetFilter(player.grabshape, CP_SHAPE_FILTER_ALL);
-				cpSpaceShapeQuery(space, player.grabshape, [](cpShape *shape, cpContactPointSet *points, void *data)
-				{
-					if (!shape->body->userData) return;
+//Result line of a run this build or data can't do, key and value say which one it would have been
+static void BenchSkipped(const char* scenario, const char* key, const char* value, const char* reason)
+{
+	BenchLine(ZL_String::format("{\"scenario\":\"%s\",\"%s\":\"%s\",\"skipped\":\"%s\"}", scenario, key, value, reason));
+}
 
-					//cpVect mid = cpvlerp(points->points[0].pointA, points->points[0].pointB, 0.5f);
-					cpVect off = cpvmult(cpvperp(cpvnormalize(cpvsub(shape->body->p, player.body->p))), 0.1f);
-					cpConstraint * c1 = cpPinJointNew(player.body, shape->body, cpvadd(cpv(0.4f, 0), cpBodyWorldToLocal(player.body, cpvadd(player.body->p, off))), cpBodyWorldToLocal(shape->body, cpvadd(shape->body->p, off)));
-					off = cpvneg(off);
-					cpConstraint * c2 = cpPinJointNew(player.body, shape->body, cpvadd(cpv(0.4f, 0), cpBodyWorldToLocal(player.body, cpvadd(player.body->p, off))), cpBodyWorldToLocal(shape->body, cpvadd(shape->body->p, off)));
+//Fills the room cells from the bottom row up with a pattern that has no two neighboring boxes of the same item
+static void BenchFill(int cells)
+{
+	for (int i = 0, w = (int)(game.room.r - game.room.l); i != cells; i++)
+		game.AddBox((i % w + 2 * (i / w)) % game.nitems, cpv(game.room.l + .5f + i % w, game.room.b + .5f + i / w), .91f);
+}
 
-					cpSpaceAddPostStepCallback(space, [](cpSpace *space, void *key, void *data) { cpSpaceAddConstraint(space, (cpConstraint *)key); }, c1, NULL);
-					cpSpaceAddPostStepCallback(space, [](cpSpace *space, void *key, void *data) { cpSpaceAddConstraint(space, (cpConstraint *)key); }, c2, NULL);
+static void BenchSetup()
+{
+	game.Init(1);
+	game.tickNextBox = 0x7FFFFFFF;
+	if (bench.scenario == BENCH_HALF) { game.SetRoom(8); BenchFill((int)(game.room.r - game.room.l) * (int)((game.room.t - game.room.b) / 2)); }
+	if (bench.scenario == BENCH_FULL)
+	{
+		//every cell but the one the player stands in, the game over check trips with one more box
+		game.SetRoom(40);
+		BenchFill((int)((game.room.r - game.room.l) * (game.room.t - game.room.b)) - 1);
+		cpBodySetPosition(game.player.body, cpv(game.room.r - .5f, game.room.t - .5f));
+	}
+	if (bench.scenario == BENCH_CLEAR || bench.scenario == BENCH_GRAB)
+		cpBodySetPosition(game.player.body, cpv(game.room.r - 1.5f, game.room.t - .5f));
+	if (bench.scenario == BENCH_CLEAR) game.expansion = 0x3FFFFFFF; //the room stays at level 0 however many boxes get cleared
+	if (bench.scenario == BENCH_GRAB)
+	{
+		game.player.body->a = game.player.angle = 0;
+		game.AddBox(0, cpv(game.room.r - .5f, game.room.t - .5f), .91f);
+	}
+	if (bench.scenario == BENCH_SPARKS || bench.scenario == BENCH_SPARKS_ZL) { game.SetRoom(8); sparks.count = 0; }
+	if (bench.scenario == BENCH_SPARKS_ZL)
+	{
+		bench.zlsparks = ZL_ParticleEffect(500, 200);
+		bench.zlsparks.AddParticleImage(srfGFX.Clone().SetTilesetIndex(22), 200);
+		bench.zlsparks.AddBehavior(new ZL_ParticleBehavior_LinearMove(1, 0.3f));
+		bench.zlsparks.AddBehavior(new ZL_ParticleBehavior_LinearImageProperties(1, 0, 0.03f, 0.01f));
+	}
+}
 
-				}, NULL);
-				cpShapeSetFilter(player.grabshape, CP_SHAPE_FILTER_NONE);
-				if (player.body->constraintList) sndPickup.Play();
-			}
-			if (!grab && player.body->constraintList)
+//Times the physics step with each broadphase in every room size up to the one of the full room scenario, half filled and without rendering
+static void BenchBroadphase()
+{
+	int keep = broadphase;
+	for (int lvl = 0; lvl <= 40; lvl++)
+	{
+		for (broadphase = BROADPHASE_TREE; broadphase <= BROADPHASE_HASH; broadphase++)
+		{
+			game.Init(1);
+			game.tickNextBox = 0x7FFFFFFF;
+			if (lvl) game.SetRoom(lvl);
+			BenchFill((int)(game.room.r - game.room.l) * (int)((game.room.t - game.room.b) / 2));
+			double sum = 0, max = 0;
+			for (int i = 0; i != BENCH_FRAMES; i++)
 			{
-				while (cpConstraint* c = player.body->constraintList) { cpSpaceRemoveConstraint(space, c); cpConstraintFree(c); }
-				sndDrop.Play();
+				game.prof = SProfile();
+				game.Tick(SInput());
+				game.Match();
+				game.ResetEvents();
+				sum += game.prof.step;
+				max = ZL_Math::Max(max, game.prof.step);
 			}
+			BenchLine(ZL_String::format("{\"scenario\":\"broadphase\",\"broadphase\":\"%s\",\"frames\":%d,\"level\":%d,\"room\":\"%dx%d\",\"boxes\":%d,\"step_us\":{\"avg\":%.2f,\"max\":%.2f}}",
+				BroadphaseNames[broadphase], BENCH_FRAMES, lvl, (int)(game.room.r - game.room.l), (int)(game.room.t - game.room.b), game.boxes, sum / BENCH_FRAMES, max));
+		}
+	}
+	broadphase = keep;
+}
 
-			tickNextBox -= 16;
-			if (!spawnboxbody && tickNextBox <= 0)
+//Times the physics step of the plain and the threaded solver in full rooms of three sizes and compares how far the boxes drift
+//from their cells and how fast they still move at the end, a stable solver keeps both close to zero
+static void BenchSolver()
+{
+	int keep = solverthreads;
+	#ifdef DEPOTMANIA_HASTY
+	int modes = 2;
+	#else
+	int modes = 1;
+	#endif
+	static const int levels[] = { 8, 20, 40 };
+	for (int lvl : levels)
+	{
+		for (int mode = 0; mode != modes; mode++)
+		{
+			solverthreads = (mode ? (keep ? keep : ZL_Math::Max((int)std::thread::hardware_concurrency(), 1)) : 0);
+			game.Init(1);
+			game.tickNextBox = 0x7FFFFFFF;
+			game.SetRoom(lvl);
+			BenchFill((int)((game.room.r - game.room.l) * (game.room.t - game.room.b)) - 1);
+			cpBodySetPosition(game.player.body, cpv(game.room.r - .5f, game.room.t - .5f));
+			if (mode) game.SetHasty(true);
+			double sum = 0, max = 0;
+			for (int i = 0; i != BENCH_FRAMES; i++)
 			{
-				spawnboxbody = cpSpaceAddBody(space, cpBodyNew(0.1f, cpMomentForBox(0.1f, 1, 1)));
-				cpBodySetUserData(spawnboxbody, (cpDataPointer)(itemNextBox+1));
-				cpBodySetPosition(spawnboxbody, cpv(0, room.b+.01f));
-				cpSpaceAddShape(space, cpBoxShapeNew(spawnboxbody, .01f, .01f, 0.01f));
+				game.prof = SProfile();
+				game.Tick(SInput());
+				game.Match();
+				game.ResetEvents();
+				sum += game.prof.step;
+				max = ZL_Math::Max(max, game.prof.step);
 			}
-			if (spawnboxbody)
+			double motion[2] = { 0, 0 };
+			for (const SWorld::SBox* box : game.live)
 			{
-				float f = ZL_Math::Min(-tickNextBox / 1000.0f, 1.0f);
-
-				cpBB bb = cpBBNewForCircle(cpvzero, (.01f + .9f * f) * 0.5f);
-				cpVect verts[] = { {bb.r, bb.b}, {bb.r, bb.t}, {bb.l, bb.t}, {bb.l, bb.b}, };
-				cpPolyShapeSetVerts(spawnboxbody->shapeList, 4, verts, cpTransformIdentity);
-
-				if (f == 1.0)
-				{
-					cpBodySetPositionUpdateFunc(spawnboxbody, BoxBodyUpdatePosition);
-					spawnboxbody = NULL;
-					tickNextBox = tickPerBox;
-					itemNextBox = RAND_INT_RANGE(0, nitems-1);
-				}
+				motion[0] += cpvlength(cpv(smod(box->body.p.x + 1000.f + .5f, 1.0f) - .5f, smod(box->body.p.y + 1000.f + .5f, 1.0f) - .5f));
+				motion[1] += cpvlength(box->body.v);
 			}
-
-			cpSpaceStep(space, s(16.0/1000.0));
+			BenchLine(ZL_String::format("{\"scenario\":\"solver\",\"solver\":\"%s\",\"threads\":%d,\"iterations\":%d,\"frames\":%d,\"level\":%d,\"boxes\":%d,\"step_us\":{\"avg\":%.2f,\"max\":%.2f},\"drift\":%.5f,\"speed\":%.5f}",
+				(mode ? "hasty" : "plain"), solverthreads, solveriterations, BENCH_FRAMES, lvl, game.boxes, sum / BENCH_FRAMES, max, motion[0] / game.boxes, motion[1] / game.boxes));
 		}
+	}
+	#ifndef DEPOTMANIA_HASTY
+	BenchSkipped("solver", "solver", "hasty", "built without DEPOTMANIA_HASTY");
+	#endif
+	solverthreads = keep;
+}
 
-		for (float y = room.b + .5f; y < room.t; y++)
+//Loads the images and fonts ten times over from DepotMania.pack (when there is one) and from Data with all copies kept alive,
+//then reports the time and the growth of the resident memory per set, the pack mapping itself is counted in its first round
+static void BenchAssets()
+{
+	SMappedFile pack = assetpack;
+	for (int source = 0; source != 2; source++)
+	{
+		assetpack = SMappedFile();
+		if (source == 0 && !pack.data) { BenchSkipped("assets", "source", "pack", "no DepotMania.pack, see make pack"); continue; }
+		double rss = ResidentMemory(), t = ProfileTime();
+		if (source == 0) assetpack = pack;
 		{
-			for (float x = room.l + .5f; x < room.r; x++)
+			ZL_Surface surfaces[10][3];
+			ZL_Font fonts[10][2];
+			for (int i = 0; i != 10; i++)
 			{
-				cpBody *box = GetBoxAt(x, y, false);
-				if (!box) continue;
-
-				//cpDataPointer p = box->userData;
-				//cpBody *nbox;
-				//if ((nbox = GetBoxAt(x + 1, y    , false)) == NULL || nbox->userData != p) continue;
-				//if ((nbox = GetBoxAt(x    , y + 1, false)) == NULL || nbox->userData != p) continue;
-				//if ((nbox = GetBoxAt(x + 1, y + 1, false)) == NULL || nbox->userData != p) continue;
-				//int item = (int)box->userData - 1;
-				//int area = ClearBoxAndNeighbors(box, x, y);
-
-				found.clear();
-				FillNeighbors(box, x, y);
-				if (found.size() < 4) continue;
-				int area = (int)found.size();
-				int item = (int)box->userData - 1;
-				for (cpBody* it : found)
-				{
-					particleSpark.Spawn(25, it->p, 0, .5f, .5f);
-					RemoveBody(it);
-				}
-
-				bool newclear = (itemgoals[item] == 0);
-				itemgoals[item] |= ((area >= 6) ? 3 : 1);
-				((area >= 6) ? sndStar : sndCheck).Play();
-				if (newclear)
-				{
-					bool allclear = true;
-					for (int i = 0; i != COUNT_OF(itemindices); i++)
-						if (!itemgoals[i]) { allclear = false; break; }
-					if (allclear) win = true;
-				}
-
-				score += area;
-				expansion -= area;
-				txtScore = ZL_TextBuffer(fntMain, ZL_String::format("Score: %d", score).c_str());
-				txtExpansion = ZL_TextBuffer(fntMain, ZL_String::format("Upgrade In: %d", expansion).c_str());
-				if (expansion <= 0) SetRoom(level + 1);
+				surfaces[i][0] = ZL_Surface(AssetFile("atlas.png", "Data/atlas.png"));
+				surfaces[i][1] = ZL_Surface(AssetFile("floor.png", "Data/floor.png"));
+				surfaces[i][2] = ZL_Surface(AssetFile("wall.png", "Data/wall.png"));
+				LoadFonts(fonts[i][0], fonts[i][1]);
 			}
+			t = ProfileTime() - t;
+			rss = ResidentMemory() - rss;
 		}
+		BenchLine(ZL_String::format("{\"scenario\":\"assets\",\"source\":\"%s\",\"sets\":10,\"load_ms\":%.2f,\"rss_mb\":%.3f}", (source ? "Data" : "pack"), t / 10000, rss / 10));
 	}
+	assetpack = pack;
+}
 
-	static float lastsz = 0;
-	float ar = ZL_Display::Width / ZL_Display::Height, sz = room.r + 1.0f;
-	if (!lastsz) lastsz = sz;
-	sz = lastsz = ZL_Math::Lerp(lastsz, sz, .01f);
-	ZL_Display::PushOrtho(-sz*ar, sz*ar, -sz, sz);
-
-	srfFloor.DrawTo(room.l, room.b, room.r, room.t);
+//Process CPU time of all threads in microseconds, the audio mixer runs on a thread of its own
+static double ProcessTime()
+{
+	#ifdef _WIN32
+	FILETIME created, exited, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+	return ((((unsigned long long)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) + (((unsigned long long)user.dwHighDateTime << 32) | user.dwLowDateTime)) / 10.0;
+	#else
+	rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000.0 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+	#endif
+}
 
-	if (title)
+//Compares the CPU time of three seconds of music synthesized live against streaming it from Data/music.ogg (with silence as the
+//baseline) and the time it takes to synthesize the four sound effects against decoding them from their ogg files
+static void BenchAudio()
+{
+	#ifdef DEPOTMANIA_PRERENDERED_AUDIO
+	BenchSkipped("audio", "source", "synth", "built with DEPOTMANIA_PRERENDERED_AUDIO");
+	#else
+	static const char* const files[] = { "Data/pickup.ogg", "Data/drop.ogg", "Data/check.ogg", "Data/star.ogg" };
+	static TImcSongData* const songs[] = { &imcDataIMCPICKUP, &imcDataIMCDROP, &imcDataIMCCHECK, &imcDataIMCSTAR };
+	ZL_Sound music(ZL_File("Data/music.ogg"), true);
+	bool ogg = music;
+	for (const char* file : files) ogg &= ZL_File::Exists(file);
+	imcMusic.Stop();
+	for (int source = 0; source != 3; source++)
 	{
-		if (ZL_Input::Down(ZLK_ESCAPE))
-			ZL_Application::Quit();
-
-		if (ZL_Input::Down(ZLK_RETURN) || ZL_Input::Down(ZLK_RETURN2) || ZL_Input::Down(ZLK_SPACE))
+		if (source == 2 && !ogg) { BenchSkipped("audio", "source", "ogg", "no Data/*.ogg, see make prerendered-audio"); continue; }
+		if (source == 1) imcMusic.Play(true);
+		if (source == 2) music.Play(true);
+		double load = 0;
+		ZL_Sound sounds[COUNT_OF(songs)]; //kept loaded like in the game while the music plays
+		for (int i = 0; i != COUNT_OF(songs) && source; i++)
 		{
-			Init();
-			title = false;
+			double t = ProfileTime();
+			sounds[i] = (source == 1 ? ZL_SynthImcTrack::LoadAsSample(songs[i]) : ZL_Sound(files[i]));
+			load += ProfileTime() - t;
 		}
+		double t = ProcessTime();
+		std::this_thread::sleep_for(std::chrono::seconds(3));
+		double cpu = ProcessTime() - t;
+		if (source == 1) imcMusic.Stop();
+		if (source == 2) music.Stop();
+		static const char* const names[] = { "silence", "synth", "ogg" };
+		BenchLine(ZL_String::format("{\"scenario\":\"audio\",\"source\":\"%s\",\"cpu_ms_per_s\":%.2f,\"sounds_load_ms\":%.2f}", names[source], cpu / 3000, load / 1000));
+	}
+	#endif
+}
 
-		srfWall.DrawTo(room.l - 100.f, room.b - 100.f, room.r + 100.f, room.t + 100.f);
-		ZL_Display::PopOrtho();
-
-		static ZL_TextBuffer txt(fntBig, "Depot");
-		txt.Draw(ZLHALFW-200+18, ZLHALFH+200-18, 1.5f, shadow, ZL_Origin::Center);
-		DrawTextBordered(txt, ZLV(ZLHALFW-200, ZLHALFH+200), 1.5f, ZLWHITE, ZLBLACK, 5);
-
-		static ZL_TextBuffer txt2(fntBig, "Mania");
-		ZL_Display::PushMatrix();
-		ZL_Display::Translate(ZLHALFW+200, ZLHALFH+200);
-		ZL_Display::Rotate(ssin(ZLSECONDS*20)*0.1f);
-		txt2.Draw(0+18, 0-18, 1.5f, shadow, ZL_Origin::Center);
-		DrawTextBordered(txt2, ZLV(0, 0), 1.5f, ZLWHITE, ZLBLACK, 5);
-		ZL_Display::PopMatrix();
+#ifndef DEPOTMANIA_PRERENDERED_AUDIO
+//DepotMania -renderaudio [dir] plays the music and each sound effect once through the audio mixer and records what it puts out into
+//<dir>/<name>.wav (44.1 kHz 16-bit stereo), the Makefile's prerendered-audio target turns them into the ogg files of DEPOTMANIA_PRERENDERED_AUDIO
+static struct SAudioRender { std::mutex lock; std::vector<short> pcm; size_t want; int track = -1; bool recording; const char* dir; ticks_t start; } audiorender;
 
-		static ZL_TextBuffer txt3(fntBig, "Connect 4 items of the same type to clear them");
-		DrawTextBordered(txt3, ZLV(ZLHALFW, ZLHALFH-20), .4f, ZLWHITE, ZLBLACK, 3);
-		static ZL_TextBuffer txt4(fntBig, "Connect 6 for bonus stars, clear all items once to win");
-		DrawTextBordered(txt4, ZLV(ZLHALFW, ZLHALFH-70), .4f, ZLWHITE, ZLBLACK, 3);
+static bool AudioRenderMix(short* buffer, unsigned int samples, bool need_mix)
+{
+	std::lock_guard<std::mutex> lock(audiorender.lock);
+	if (!audiorender.recording || (!need_mix && audiorender.pcm.empty())) return false; //the track has not started yet
+	size_t n = ZL_Math::Min((size_t)samples * 2, audiorender.want - audiorender.pcm.size());
+	if (need_mix) audiorender.pcm.insert(audiorender.pcm.end(), buffer, buffer + n);
+	else audiorender.pcm.resize(audiorender.pcm.size() + n, 0);
+	if (audiorender.pcm.size() == audiorender.want) audiorender.recording = false;
+	return false;
+}
 
-		static ZL_TextBuffer txt5(fntBig, "Use Arrows or WASD to Move");
-		DrawTextBordered(txt5, ZLV(ZLHALFW, ZLHALFH-160), .5f, ZLWHITE, ZLBLACK, 3);
-		static ZL_TextBuffer txt6(fntBig, "Hold Space to Carry Items");
-		DrawTextBordered(txt6, ZLV(ZLHALFW, ZLHALFH-215), .5f, ZLWHITE, ZLBLACK, 3);
-		static ZL_TextBuffer txt7(fntBig, "Hold Shift to Strafe (Move without Turning)");
-		DrawTextBordered(txt7, ZLV(ZLHALFW, ZLHALFH-280), .5f, ZLWHITE, ZLBLACK, 3);
+static bool WriteWav(const char* path, const std::vector<short>& pcm)
+{
+	FILE* f = fopen(path, "wb");
+	if (!f) return false;
+	unsigned int bytes = (unsigned int)(pcm.size() * sizeof(short));
+	unsigned int hdr[] = { 0x46464952, 36 + bytes, 0x45564157, 0x20746D66, 16, 0x00020001, 44100, 44100 * 4, 0x00100004, 0x61746164, bytes }; //RIFF WAVE fmt  PCM stereo 16-bit data
+	bool ok = (fwrite(hdr, sizeof(hdr), 1, f) == 1 && fwrite(pcm.data(), 1, bytes, f) == bytes);
+	fclose(f);
+	return ok;
+}
 
-		static ZL_TextBuffer txt8(fntMain, "(C) 2023 by Bernhard Schelling");
-		DrawTextBordered(txt8, ZLV(ZLHALFW, 20), .7f, ZLWHITE*.7f, ZLBLACK, 2);
+//Only the recording state is touched under the lock, the mixer hook runs inside the mixer's own lock so calling
+//into the mixer or the synth while holding it could deadlock with the audio thread
+static void AudioRender()
+{
+	static const char* const names[] = { "music", "pickup", "drop", "check", "star" };
+	static TImcSongData* const songs[] = { &imcDataIMCMUSIC, &imcDataIMCPICKUP, &imcDataIMCDROP, &imcDataIMCCHECK, &imcDataIMCSTAR };
+	static ZL_Sound effect;
+	std::vector<short> pcm;
+	int track;
+	{
+		std::lock_guard<std::mutex> lock(audiorender.lock);
+		if (audiorender.recording && (!audiorender.pcm.empty() || ZLSINCE(audiorender.start) < 2000)) return;
+		track = audiorender.track;
+		if (audiorender.recording) track = -2; //nothing came out of the mixer
+		audiorender.recording = false;
+		pcm.swap(audiorender.pcm);
+	}
+	if (track == -2)
+	{
+		fprintf(stderr, "No audio came out of the mixer for %s\n", names[audiorender.track]);
+		ZL_Application::Quit(1);
 		return;
 	}
-
-	boxes = 0;
-	cpSpaceEachShape(space, DrawBox, NULL);
-	if (boxes > (room.r - room.l)*(room.t - room.b)-1) gameover = 1;
-
-	srfPlayer.Draw(ZLV(0.1,-0.1) + player.body->p, player.body->a, ZLLUMA(0, 0.75));
-	srfPlayer.Draw(player.body->p, player.body->a);
-	ZL_Display::FillGradient(room.l, room.t - .3f, room.r, room.t, ZLBLACK, ZLBLACK, ZLTRANSPARENT, ZLTRANSPARENT);
-	ZL_Display::FillGradient(room.l, room.b, room.l + .3f, room.t, ZLBLACK, ZLTRANSPARENT, ZLBLACK, ZLTRANSPARENT);
-	ZL_Display::FillGradient(room.l, room.b, room.r, room.b + .1f, ZLTRANSPARENT, ZLTRANSPARENT, ZLBLACK, ZLBLACK);
-	ZL_Display::FillGradient(room.r - .1f, room.b, room.r, room.t, ZLTRANSPARENT, ZLBLACK, ZLTRANSPARENT, ZLBLACK);
-
-	srfWall.DrawTo(room.l - 100.f, room.t, room.r + 100.f, room.t + 100.f);
-	srfWall.DrawTo(room.l - 100.f, room.b - 100.f, room.r + 100.f, room.b);
-	srfWall.DrawTo(room.l - 100.f, room.b, room.l, room.t);
-	srfWall.DrawTo(room.r, room.b, room.r + 100.f, room.t);
-	if (!spawnboxbody && tickNextBox)
+	if (track >= 0)
 	{
-		float f = (float)(tickNextBox) / tickPerBox;
-		if (f <= 1.0f)
-			srfGFX.SetTilesetIndex(itemindices[itemNextBox]).Draw(0, room.b-0.1f-0.4f*f, 0.02f*(f+0.3f), 0.02f*(f+0.3f), ZLLUMA(0.8,0.8));
+		if (track) effect.Stop();
+		else imcMusic.Stop();
+		if (track) //effects end in silence up to the length of their pattern, the music is kept at exactly one loop
+			while (pcm.size() > 2 && abs(pcm[pcm.size() - 1]) < 8 && abs(pcm[pcm.size() - 2]) < 8) pcm.resize(pcm.size() - 2);
+		ZL_String path = ZL_String::format("%s/%s.wav", audiorender.dir, names[track]);
+		if (!WriteWav(path.c_str(), pcm)) { fprintf(stderr, "Could not write %s\n", path.c_str()); ZL_Application::Quit(1); return; }
+		printf("Wrote %s (%.2f seconds)\n", path.c_str(), pcm.size() / 2 / 44100.0);
 	}
-	ZL_Display::FillGradient(-0.5f, room.b-0.3f, 0.5f, room.b, ZLBLACK, ZLBLACK, ZLTRANSPARENT, ZLTRANSPARENT);
-
-	particleSpark.Draw();
-
-	#ifdef ZILLALOG //DEBUG DRAW
-	if (ZL_Input::Held(ZLK_RSHIFT)) { void DebugDrawConstraint(cpConstraint*, void*); cpSpaceEachConstraint(space, DebugDrawConstraint, NULL); }
-	if (ZL_Input::Held(ZLK_RSHIFT)) { void DebugDrawShape(cpShape*,void*); cpSpaceEachShape(space, DebugDrawShape, NULL); }
-	#endif
+	if (++track == COUNT_OF(names)) { ZL_Audio::UnhookAudioMix(AudioRenderMix); ZL_Application::Quit(); return; }
+	TImcSongData* song = songs[track];
+	if (track) effect = ZL_SynthImcTrack::LoadAsSample(song);
+	{
+		std::lock_guard<std::mutex> lock(audiorender.lock);
+		audiorender.track = track;
+		audiorender.want = (size_t)song->LEN * 32 * song->ROWLENSAMPLES * 2; //32 rows per pattern
+		audiorender.recording = true;
+		audiorender.start = ZLTICKS;
+	}
+	if (track) effect.Play();
+	else imcMusic.Play(true);
+}
+#endif
 
-	ZL_Display::PopOrtho();
-	txtItems.Draw(10+3, ZLFROMH(40)-3, shadow);
-	txtItems.Draw(10, ZLFROMH(40));
-	txtScore.Draw(10+3, ZLFROMH(80)-3, shadow);
-	txtScore.Draw(10, ZLFROMH(80));
-	txtExpansion.Draw(10+3, ZLFROMH(120)-3, shadow);
-	txtExpansion.Draw(10, ZLFROMH(120));
-	for (int i = 0; i != nitems; i++)
+static void Bench()
+{
+	if (!bench.frame) { BenchSetup(); bench.sum = bench.max = SProfile(); }
+	if (bench.scenario == BENCH_CLEAR && !game.boxes)
 	{
-		srfGFX.Draw(158.0f + i * 40.f+3, ZLFROMH(32)-3, shadow);
-		srfGFX.SetTilesetIndex(itemindices[i]).Draw(158.0f + i * 40.f, ZLFROMH(32));
-		if (itemgoals[i] & 1) srfCheck.Draw(158.0f + i * 40.f, ZLFROMH(32));
-		if (itemgoals[i] & 2) srfStar.Draw(158.0f + i * 40.f, ZLFROMH(32));
+		memset(game.itemgoals, 0, sizeof(game.itemgoals)); //every clear is the first of its item like the first one
+		for (int i = 0; i != 9; i++) game.AddBox(0, cpv(game.room.l + .5f + i % 3, game.room.b + .5f + i / 3), .91f);
 	}
 
-	if (gameover)
+	SInput in = { 0, 0, (bench.scenario == BENCH_GRAB && (bench.frame & 1)), false };
+	game.prof = SProfile();
+	game.Tick(in);
+	game.Match();
+	if ((bench.scenario == BENCH_SPARKS || bench.scenario == BENCH_SPARKS_ZL) && bench.frame % 15 == 0)
+		for (int i = 0; i != 40; i++) game.events.sparks.push_back(cpv(game.room.l + .5f + i % 5, game.room.b + .5f + (i / 5) % 5));
+
+	float ar = ZL_Display::Width / ZL_Display::Height, sz = game.room.r + 1.0f;
+	ZL_Display::ClearFill(ZLBLACK);
+	ZL_Display::PushOrtho(-sz*ar, sz*ar, -sz, sz);
+	double t = ProfileTime();
+	DrawBoxes();
+	game.prof.boxes = ProfileTime() - t;
+	t = ProfileTime();
+	if (bench.scenario == BENCH_SPARKS_ZL)
 	{
-		if (ZL_Input::Down(ZLK_ESCAPE)) title = true;
-		static ZL_TextBuffer txt(fntBig, "Game Over");
-		DrawTextBordered(txt, ZLCENTER, 1.5f, ZLWHITE, ZLBLACK, 5);
-		static ZL_TextBuffer txt2(fntBig, "Press ESC to Return to Title");
-		DrawTextBordered(txt2, ZLV(ZLHALFW, ZLHALFH-160), .5f, ZLWHITE, ZLBLACK, 3);
+		for (const cpVect& p : game.events.sparks) bench.zlsparks.Spawn(25, p, 0, .5f, .5f);
+		bench.zlsparks.Draw();
 	}
-	if (win)
+	else
 	{
-		if (ZL_Input::Down(ZLK_ESCAPE)) win = false;
-		static ZL_TextBuffer txt(fntBig, "You Win! Congratulation!");
-		DrawTextBordered(txt, ZLCENTER, 1.5f, ZLWHITE, ZLBLACK, 5);
-		static ZL_TextBuffer txt2(fntBig, "Thank you for playing");
-		DrawTextBordered(txt2, ZLV(ZLHALFW, ZLHALFH-110), .5f, ZLWHITE, ZLBLACK, 3);
-		static ZL_TextBuffer txt3(fntBig, "Press ESC to Continue Playing");
-		DrawTextBordered(txt3, ZLV(ZLHALFW, ZLHALFH-190), .5f, ZLWHITE, ZLBLACK, 3);
+		sparks.Spawn(game.events.sparks);
+		sparks.Update(ZLELAPSED);
+		sparks.Draw();
 	}
-	if (goback)
+	game.prof.particles = ProfileTime() - t;
+	game.ResetEvents();
+	ZL_Display::PopOrtho();
+
+	static const struct { const char* name; double SProfile::*field; } sections[] = { { "step", &SProfile::step }, { "match", &SProfile::match }, { "boxes", &SProfile::boxes }, { "particles", &SProfile::particles } };
+	for (int i = 0; i != COUNT_OF(sections); i++)
 	{
-		if (ZL_Input::Down(ZLK_ESCAPE)) title = true;
-		if (ZL_Input::Down(ZLK_SPACE)) goback = false;
-		static ZL_TextBuffer txt(fntBig, "Paused");
-		DrawTextBordered(txt, ZLCENTER, 1.5f, ZLWHITE, ZLBLACK, 5);
-		static ZL_TextBuffer txt2(fntBig, "Press ESC to Return to Title");
-		DrawTextBordered(txt2, ZLV(ZLHALFW, ZLHALFH-110), .5f, ZLWHITE, ZLBLACK, 3);
-		static ZL_TextBuffer txt3(fntBig, "Press Space to Continue Playing");
-		DrawTextBordered(txt3, ZLV(ZLHALFW, ZLHALFH-190), .5f, ZLWHITE, ZLBLACK, 3);
+		bench.sum.*sections[i].field += game.prof.*sections[i].field;
+		bench.max.*sections[i].field = ZL_Math::Max(bench.max.*sections[i].field, game.prof.*sections[i].field);
 	}
+	if (++bench.frame != BENCH_FRAMES) return;
+
+	ZL_String line = ZL_String::format("{\"scenario\":\"%s\",\"frames\":%d,\"level\":%d,\"boxes\":%d", BenchNames[bench.scenario], BENCH_FRAMES, game.level, game.boxes);
+	for (int i = 0; i != COUNT_OF(sections); i++)
+		line += ZL_String::format(",\"%s_us\":{\"avg\":%.2f,\"max\":%.2f}", sections[i].name, bench.sum.*sections[i].field / BENCH_FRAMES, bench.max.*sections[i].field);
+	BenchLine(line + "}");
+
+	bench.frame = 0;
+	if (++bench.scenario != BENCH_COUNT) return;
+	BenchBroadphase();
+	BenchSolver();
+	BenchAudio();
+	BenchAssets();
+	if (bench.out) fclose(bench.out);
+	ZL_Application::Quit();
 }
 
 static struct sDepotMania : public ZL_Application
 {
-	sDepotMania() : ZL_Application(60) { }
+	sDepotMania() : ZL_Application(0) { } //no frame rate limit, bodies are drawn interpolated between physics steps
 
 	virtual void Load(int argc, char *argv[])
 	{
+		//DepotMania -headless [games] [max ticks per game] [first seed]
+		//DepotMania -replay <file> [-fast]
+		//DepotMania -bench [output file]
+		//DepotMania -batch [worlds] [threads] [ticks] [first seed]
+		//DepotMania -stress [room size] [item types] [ms per box] [spawn points]
+		//DepotMania -coop host [port] [input delay ticks]
+		//DepotMania -coop join <address> [port] [input delay ticks]
+		//DepotMania -coop selftest [ticks] [port]
+		//Physics options can be given anywhere and are taken out before the mode arguments are read:
+		//  -broadphase <tree|hash>
+		//  -iterations <solver iterations>
+		//  -threads <threaded solver threads, 0 for off> -hastyboxes <box count to switch to the threaded solver at>
+		//  -telemetry <file>
+		//DepotMania -readtelemetry <file> [-follow]
+		//DepotMania -renderaudio [output directory]
+		for (int i = 1; i < argc; i++)
+		{
+			int n = 0;
+			if (!strcmp(argv[i], "-broadphase") && i + 1 < argc) { broadphase = (!strcmp(argv[i+1], "hash") ? BROADPHASE_HASH : BROADPHASE_TREE); n = 2; }
+			if (!strcmp(argv[i], "-iterations") && i + 1 < argc) { solveriterations = ZL_Math::Max(atoi(argv[i+1]), 1); n = 2; }
+			if (!strcmp(argv[i], "-threads") && i + 1 < argc) { solverthreads = ZL_Math::Max(atoi(argv[i+1]), 0); n = 2; }
+			if (!strcmp(argv[i], "-hastyboxes") && i + 1 < argc) { hastyboxes = ZL_Math::Max(atoi(argv[i+1]), 0); n = 2; }
+			if (!strcmp(argv[i], "-telemetry") && i + 1 < argc) { if (!TelemetryOpen(argv[i+1])) printf("Could not open telemetry %s\n", argv[i+1]); n = 2; }
+			if (!n) continue;
+			#ifndef DEPOTMANIA_HASTY
+			if (!strcmp(argv[i], "-threads") || !strcmp(argv[i], "-hastyboxes"))
+			{
+				fprintf(stderr, "%s needs a build with DEPOTMANIA_HASTY (make HASTY=1)\n", argv[i]);
+				ZL_Application::Quit(1);
+				return;
+			}
+			#endif
+			for (int j = i; j + n < argc; j++) argv[j] = argv[j + n];
+			argc -= n;
+			i--;
+		}
+		if (argc > 2 && !strcmp(argv[1], "-readtelemetry"))
+		{
+			headless = true;
+			ReadTelemetry(argv[2], (argc > 3 && !strcmp(argv[3], "-follow")));
+			ZL_Application::Quit();
+			return;
+		}
+		unsigned int replayseed = 0;
+		bool replay = (argc > 2 && !strcmp(argv[1], "-replay"));
+		if (replay && !LoadReplay(argv[2], &replayseed)) { printf("Could not load replay %s\n", argv[2]); ZL_Application::Quit(1); return; }
+		if (replay && argc > 3 && !strcmp(argv[3], "-fast"))
+		{
+			headless = true;
+			game.Init(replayseed);
+			FastReplay();
+			ZL_Application::Quit();
+			return;
+		}
+		if (argc > 1 && !strcmp(argv[1], "-headless"))
+		{
+			headless = true;
+			Headless((argc > 2 ? atoi(argv[2]) : 100), (argc > 3 ? atoi(argv[3]) : 225000), (argc > 4 ? (unsigned int)strtoul(argv[4], NULL, 10) : 1));
+			ZL_Application::Quit();
+			return;
+		}
+		if (argc > 1 && !strcmp(argv[1], "-batch"))
+		{
+			headless = true;
+			BatchRandom((argc > 2 ? atoi(argv[2]) : 64), (argc > 3 ? atoi(argv[3]) : (int)std::thread::hardware_concurrency()), (argc > 4 ? atoi(argv[4]) : 10000), (argc > 5 ? (unsigned int)strtoul(argv[5], NULL, 10) : 1));
+			ZL_Application::Quit();
+			return;
+		}
+		if (argc > 1 && !strcmp(argv[1], "-stress"))
+		{
+			stress.size = ZL_Math::Max((argc > 2 ? atoi(argv[2]) : 41), 3);
+			stress.items = ZL_Math::Clamp((argc > 3 ? atoi(argv[3]) : 32), 2, (int)ITEMS_MAX);
+			stress.tickPerBox = ZL_Math::Max((argc > 4 ? atoi(argv[4]) : 200), 16);
+			stress.spawners = ZL_Math::Max((argc > 5 ? atoi(argv[5]) : 4), 1);
+		}
+		if (argc > 2 && !strcmp(argv[1], "-coop") && !strcmp(argv[2], "selftest"))
+		{
+			headless = true;
+			bool ok = CoopSelfTest((argc > 3 ? ZL_Math::Max(atoi(argv[3]), 1) : 3600), (unsigned short)(argc > 4 ? atoi(argv[4]) : COOP_PORT));
+			ZL_Application::Quit(ok ? 0 : 1);
+			return;
+		}
+		if (argc > 2 && !strcmp(argv[1], "-coop"))
+		{
+			bool join = (!strcmp(argv[2], "join") && argc > 3);
+			int a = (join ? 4 : 3);
+			if (!coop.Open((join ? argv[3] : NULL), (unsigned short)(argc > a ? atoi(argv[a]) : COOP_PORT), (argc > a + 1 ? atoi(argv[a + 1]) : COOP_DELAY)))
+			{
+				printf("Could not open the co-op connection\n");
+				ZL_Application::Quit(1);
+				return;
+			}
+		}
+		if (coop.active) telemetry.world = &coop.world;
 		if (!ZL_Application::LoadReleaseDesktopDataBundle()) return;
 		if (!ZL_Display::Init("Depot Mania", 1280, 720, ZL_DISPLAY_ALLOWRESIZEHORIZONTAL)) return;
 		ZL_Display::ClearFill(ZL_Color::White);
@@ -499,11 +2986,52 @@ static struct sDepotMania : public ZL_Application
 		ZL_Audio::Init();
 		ZL_Input::Init();
 		::Load();
-		::Init();
+		if (replay || stress.size || coop.active || (argc > 1 && !strcmp(argv[1], "-bench"))) LoadPoll(true);
+		#ifndef DEPOTMANIA_PRERENDERED_AUDIO
+		if (argc > 1 && !strcmp(argv[1], "-renderaudio"))
+		{
+			LoadPoll(true);
+			imcMusic.Stop();
+			audiorender.dir = (argc > 2 ? argv[2] : "Data");
+			ZL_Audio::HookAudioMix(AudioRenderMix);
+			return;
+		}
+		#endif
+		if (argc > 1 && !strcmp(argv[1], "-bench"))
+		{
+			bench.active = true;
+			bench.out = fopen((argc > 2 ? argv[2] : "DepotMania-bench.json"), "w");
+			return;
+		}
+		if (replay)
+		{
+			game.Init(replayseed);
+			title = false;
+		}
+		else game.Init((unsigned int)RAND_INT_MAX(0x7FFFFFFF));
+		if (stress.size || coop.active) title = false;
 	}
 	virtual void AfterFrame()
 	{
+		if (headless) return;
+		LoadPoll(false);
+		if (bench.active) { ::Bench(); return; }
+		#ifndef DEPOTMANIA_PRERENDERED_AUDIO
+		if (audiorender.dir) { ::AudioRender(); return; }
+		#endif
+		game.prof = SProfile();
+		double t = ProfileTime();
 		::Frame();
+		game.prof.frame = ProfileTime() - t;
+		if (!title) Telemetry(telemetry.world, TELEMETRY_FRAME, game.prof.substeps, game.boxes, (int)sparks.count, (float)(game.prof.frame / 1000), (float)(game.prof.step / 1000));
+		if (stress.size && !title) ::StressReport();
+		::Profiler();
+	}
+	virtual void OnQuit()
+	{
+		telemetry.file.Close();
+		MemoryReport(stderr); //stdout is kept for the output of the command line modes
+		assetpack.Close();
 	}
 } DepotMania;
 
@@ -529,7 +3057,7 @@ void DebugDrawShape(cpShape *shape, void*)
 			ZL_Display::DrawLine(poly->planes[poly->count-1].v0, poly->planes[0].v0, ZLWHITE);
 			break; }
 	}
-	if (shape->body == roombody) return;
+	if (shape->body == game.roombody) return;
 	ZL_Display::FillCircle(cpBodyGetPosition(shape->body), .1f, ZL_Color::Red);
 	ZL_Display::DrawLine(cpBodyGetPosition(shape->body), (ZL_Vector&)cpBodyGetPosition(shape->body) + ZLV(cpBodyGetAngularVelocity(shape->body)*-2, 0), ZLRGB(1,0,0));
 	ZL_Display::DrawLine(cpBodyGetPosition(shape->body), (ZL_Vector&)cpBodyGetPosition(shape->body) + ZL_Vector::FromAngle(cpBodyGetAngle(shape->body))*2, ZLRGB(1,1,0));
@@ -566,6 +3094,7 @@ void DebugDrawConstraint(cpConstraint *constraint, void *data)
 	}
 }
 #endif
+#ifndef DEPOTMANIA_PRERENDERED_AUDIO
 static const unsigned int IMCMUSIC_OrderTable[] = {
 	0x011000001, 0x012000002, 0x011000002, 0x012000001, 0x023000003, 0x013000003, 0x023000004, 0x024000005,
 };
@@ -765,3 +3294,4 @@ TImcSongData imcDataIMCSTAR = {
 	/*LEN*/ 0x1, /*ROWLENSAMPLES*/ 2594, /*ENVLISTSIZE*/ 3, /*ENVCOUNTERLISTSIZE*/ 4, /*OSCLISTSIZE*/ 4, /*EFFECTLISTSIZE*/ 2, /*VOL*/ 63,
 	IMCSTAR_OrderTable, IMCSTAR_PatternData, IMCSTAR_PatternLookupTable, IMCSTAR_EnvList, IMCSTAR_EnvCounterList, IMCSTAR_OscillatorList, IMCSTAR_EffectList,
 	IMCSTAR_ChannelVol, IMCSTAR_ChannelEnvCounter, IMCSTAR_ChannelStopNote };
+#endif